@@ -0,0 +1,95 @@
+#include "mancala.h"
+
+/*
+ * plays seat's pit: its pebbles are sown one per pit to the right, into
+ * seat's own end pit but skipping everyone else's, wrapping around the seats
+ *
+ * returns 1 if the last pebble landed in seat's end pit (an extra move),
+ * 0 if not and -1 if the move was invalid (boards are then left untouched)
+ */
+int mancala_sow(int *boards[], int nseats, int seat, int pit) {
+    int side = seat;
+    int pebbles;
+
+    if (pit < 0 || pit >= NPITS || boards[seat][pit] == 0) {
+        return -1;
+    }
+
+    // selected pit is emptied
+    pebbles = boards[seat][pit];
+    boards[seat][pit] = 0;
+
+    while (pebbles > 0) {
+        pit++;
+
+        // if we are on the moving seat's side and have not gone past its
+        // end pit OR on any other side and have not reached its end pit...
+        if ((side == seat && pit <= NPITS) || (side != seat && pit < NPITS)) {
+            boards[side][pit] += 1;
+        } else {
+            // ...else move on to the next side's first non-end pit
+            side = (side + 1) % nseats;
+            pit = 0;
+            boards[side][pit] += 1;
+        }
+        pebbles--;
+    }
+
+    return side == seat && pit == NPITS;
+}
+
+/*
+ * returns the average number of pebbles in the seats' non-end pits (rounded up),
+ * which is what a player joining a game in progress starts with per pit
+ *
+ * returns NPEBBLES when there are no seats yet
+ */
+int mancala_average_pebbles(int *boards[], int nseats) {
+    int npebbles = 0;
+
+    if (nseats == 0) {
+        return NPEBBLES;
+    }
+
+    for (int s = 0; s < nseats; s++) {
+        for (int i = 0; i < NPITS; i++) {
+            npebbles += boards[s][i];
+        }
+    }
+
+    return ((npebbles - 1) / nseats / NPITS + 1);  /* round up */
+}
+
+/*
+ * returns 1 if any seat's non-end pits are all empty (the game is over);
+ * returns 0 otherwise
+ */
+int mancala_side_empty(int *boards[], int nseats) { /* boolean */
+    for (int s = 0; s < nseats; s++) {
+        int is_all_empty = 1;
+
+        for (int i = 0; i < NPITS; i++) {
+            if (boards[s][i]) {
+                is_all_empty = 0;
+            }
+        }
+        if (is_all_empty) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * returns the points of a board: every pebble left on it, end pit included
+ */
+int mancala_score(int *board) {
+    int points = 0;
+
+    for (int i = 0; i <= NPITS; i++) {
+        points += board[i];
+    }
+
+    return points;
+}
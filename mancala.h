@@ -0,0 +1,19 @@
+#ifndef MANCALA_H
+#define MANCALA_H
+
+#define NPITS 6  /* number of pits on a side, not including the end pit */
+#define NPEBBLES 4 /* initial number of pebbles per pit */
+
+/*
+ * the game rules, shared by the server (mancsrv) and the simulator (mancsim)
+ *
+ * a board is an int[NPITS+1] per seat: [0..NPITS-1] are the regular pits,
+ * [NPITS] is the end pit. boards[] lists the seats in turn order
+ */
+
+extern int mancala_sow(int *boards[], int nseats, int seat, int pit);
+extern int mancala_average_pebbles(int *boards[], int nseats);
+extern int mancala_side_empty(int *boards[], int nseats);  /* boolean */
+extern int mancala_score(int *board);
+
+#endif
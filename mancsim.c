@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "mancala.h"
+
+#define MAXSEATS 6 /* most seats a simulated game can have */
+#define MAXTURNS 10000 /* moves after which a game is given up on as unfinished */
+#define MAXTHREADS 256 /* most worker threads */
+#define BATCH 1024 /* games a worker claims at a time */
+#define HIST_BUCKETS 512 /* game lengths (in moves) tracked one by one; longer ones share the last bucket */
+
+enum strategy { RANDOM, GREEDY };
+
+// results of a set of games, kept per worker and merged into totals
+struct stats {
+    long long games;
+    long long unfinished; // games that hit MAXTURNS
+    long long ties; // finished games with more than one top scorer
+    long long wins[MAXSEATS]; // finished games won outright, by seat
+    long long points[MAXSEATS]; // end-of-game points, by seat
+    long long seated[MAXSEATS]; // finished games the seat took part in
+    long long moves; // moves of finished games
+    long long extra_moves; // moves of finished games that earned another one
+    long long length[HIST_BUCKETS]; // finished games by number of moves
+};
+
+long long ngames = 1000000; // games to play
+int nthreads = 0; // worker threads, 0 for one per online CPU
+int nseats = 2;
+int late_turn = 0; // move after which one more seat joins, 0 if nobody joins late
+unsigned long long seed = 0;
+enum strategy strategies[MAXSEATS]; // bot playing each seat
+
+long long next_game = 0; // first game not yet claimed by a worker
+struct stats totals;
+
+extern void parseargs(int argc, char **argv);
+
+/*
+ * returns the next number of the splitmix64 sequence in *state
+ * (used to derive independent per-batch seeds)
+ */
+unsigned long long splitmix64(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * returns the next number of the xorshift64* sequence in *state
+ */
+unsigned long long xorshift64(unsigned long long *state) {
+    unsigned long long x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * returns the pit the bot for seat plays
+ *
+ * RANDOM picks any non-empty pit. GREEDY takes an extra move when it can
+ * (the rightmost one, so the others stay available), else its fullest pit
+ */
+int choose_pit(int *board, enum strategy strategy, unsigned long long *rng) {
+    int candidates[NPITS];
+    int ncandidates = 0;
+    int best = -1;
+
+    for (int i = 0; i < NPITS; i++) {
+        if (board[i] > 0) {
+            candidates[ncandidates++] = i;
+        }
+    }
+
+    if (strategy == GREEDY) {
+        for (int i = NPITS - 1; i >= 0; i--) {
+            if (board[i] == NPITS - i) {
+                return i;
+            }
+        }
+        for (int i = 0; i < NPITS; i++) {
+            if (board[i] > 0 && (best == -1 || board[i] > board[best])) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // (multiply-shift maps the top 32 random bits onto 0..ncandidates-1 without a division)
+    return candidates[((xorshift64(rng) >> 32) * ncandidates) >> 32];
+}
+
+/*
+ * plays a single game, adding its results to stats
+ *
+ * seats move in turn order, the same way rooms do on the server: an extra
+ * move keeps the seat, and the game ends once any seat's side is empty
+ */
+void play_game(struct stats *stats, unsigned long long *rng) {
+    int pits[MAXSEATS][NPITS + 1];
+    int *boards[MAXSEATS];
+    int seats = nseats;
+    int seat = 0;
+    int turns = 0;
+    int extra_moves = 0;
+    int best, nbest;
+    int extra_m;
+
+    for (int s = 0; s < MAXSEATS; s++) {
+        boards[s] = pits[s];
+    }
+    for (int s = 0; s < seats; s++) {
+        for (int i = 0; i < NPITS; i++) {
+            pits[s][i] = NPEBBLES;
+        }
+        pits[s][NPITS] = 0;
+    }
+
+    while (!mancala_side_empty(boards, seats)) {
+        if (turns == MAXTURNS) {
+            stats->games++;
+            stats->unfinished++;
+            return;
+        }
+
+        // the late joiner is seated last and starts with the average pebble count
+        if (late_turn > 0 && turns == late_turn && seats < MAXSEATS) {
+            int num_pebbles = mancala_average_pebbles(boards, seats);
+
+            for (int i = 0; i < NPITS; i++) {
+                pits[seats][i] = num_pebbles;
+            }
+            pits[seats][NPITS] = 0;
+            seats++;
+        }
+
+        extra_m = mancala_sow(boards, seats, seat, choose_pit(pits[seat], strategies[seat], rng));
+        turns++;
+
+        if (extra_m == 1) {
+            extra_moves++;
+        } else {
+            seat = (seat + 1) % seats;
+        }
+    }
+
+    // moves are only counted for finished games, like their lengths
+    stats->games++;
+    stats->moves += turns;
+    stats->extra_moves += extra_moves;
+    stats->length[turns < HIST_BUCKETS ? turns : HIST_BUCKETS - 1]++;
+
+    best = -1;
+    nbest = 0;
+    for (int s = 0; s < seats; s++) {
+        int points = mancala_score(pits[s]);
+
+        stats->points[s] += points;
+        stats->seated[s]++;
+        if (best == -1 || points > mancala_score(pits[best])) {
+            best = s;
+            nbest = 1;
+        } else if (points == mancala_score(pits[best])) {
+            nbest++;
+        }
+    }
+
+    if (nbest > 1) {
+        stats->ties++;
+    } else {
+        stats->wins[best]++;
+    }
+}
+
+/*
+ * adds count to *total, lock-free
+ */
+void merge(long long *total, long long count) {
+    if (count != 0) {
+        __atomic_fetch_add(total, count, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * worker thread: claims BATCH games at a time until all are played,
+ * then merges its thread-local stats into totals
+ */
+void *worker(void *arg) {
+    unsigned long long rng;
+    unsigned long long seed_state = seed;
+    unsigned long long base = splitmix64(&seed_state);
+    struct stats *stats = calloc(1, sizeof(struct stats));
+    long long first;
+
+    if (stats == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    while ((first = __atomic_fetch_add(&next_game, BATCH, __ATOMIC_RELAXED)) < ngames) {
+        long long last = first + BATCH < ngames ? first + BATCH : ngames;
+
+        // every batch gets its own RNG stream, derived from the seed and the
+        // batch alone, so results do not depend on which thread plays it
+        // (the seed is mixed first, so nearby seeds do not share streams)
+        seed_state = base + (unsigned long long) (first / BATCH) * 0xd1b54a32d192ed03ULL;
+        rng = splitmix64(&seed_state) | 1;
+
+        for (long long g = first; g < last; g++) {
+            play_game(stats, &rng);
+        }
+    }
+
+    merge(&totals.games, stats->games);
+    merge(&totals.unfinished, stats->unfinished);
+    merge(&totals.ties, stats->ties);
+    merge(&totals.moves, stats->moves);
+    merge(&totals.extra_moves, stats->extra_moves);
+    for (int s = 0; s < MAXSEATS; s++) {
+        merge(&totals.wins[s], stats->wins[s]);
+        merge(&totals.points[s], stats->points[s]);
+        merge(&totals.seated[s], stats->seated[s]);
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        merge(&totals.length[i], stats->length[i]);
+    }
+
+    free(stats);
+    return NULL;
+}
+
+/*
+ * returns the smallest game length (in moves) at or below which
+ * fraction of the finished games ended
+ */
+int length_percentile(double fraction) {
+    long long finished = totals.games - totals.unfinished;
+    long long seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += totals.length[i];
+        if (seen >= fraction * finished) {
+            return i;
+        }
+    }
+
+    return HIST_BUCKETS - 1;
+}
+
+/*
+ * prints the results collected in totals
+ */
+void report(double seconds) {
+    long long finished = totals.games - totals.unfinished;
+    int seats = nseats + (late_turn > 0);
+    int shortest = -1, longest = 0;
+
+    printf("%lld games with %d seats%s in %.2fs (%.0f games/s, %d threads)\n",
+            totals.games, nseats, late_turn > 0 ? " + a late joiner" : "", seconds,
+            totals.games / seconds, nthreads);
+    if (totals.unfinished > 0) {
+        printf("%lld games were given up after %d moves\n", totals.unfinished, MAXTURNS);
+    }
+    if (finished == 0) {
+        return;
+    }
+
+    printf("\nseat  strategy  wins     win rate  avg points\n");
+    for (int s = 0; s < seats; s++) {
+        // (the late joiner only sits down in games that last long enough)
+        if (totals.seated[s] == 0) {
+            continue;
+        }
+        printf("%-5d %-9s %-8lld %6.2f%%   %.2f\n", s, strategies[s] == GREEDY ? "greedy" : "random",
+                totals.wins[s], 100.0 * totals.wins[s] / finished,
+                (double) totals.points[s] / totals.seated[s]);
+    }
+    printf("ties  %-18lld %6.2f%%\n", totals.ties, 100.0 * totals.ties / finished);
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (totals.length[i] > 0) {
+            if (shortest == -1) {
+                shortest = i;
+            }
+            longest = i;
+        }
+    }
+
+    printf("\ngame length (moves): mean %.1f, min %d, p50 %d, p90 %d, p99 %d, max %d%s\n",
+            (double) totals.moves / finished, shortest, length_percentile(0.5),
+            length_percentile(0.9), length_percentile(0.99), longest,
+            longest == HIST_BUCKETS - 1 ? "+" : "");
+
+    // histogram in buckets of 10 moves, scaled to the most common bucket
+    long long buckets[HIST_BUCKETS / 10 + 1];
+    long long most = 0;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        buckets[i / 10] += totals.length[i];
+    }
+    for (int b = 0; b <= HIST_BUCKETS / 10; b++) {
+        if (buckets[b] > most) {
+            most = buckets[b];
+        }
+    }
+    for (int b = shortest / 10; b <= longest / 10; b++) {
+        printf("%4d-%-4d %6.2f%% ", b * 10, b * 10 + 9, 100.0 * buckets[b] / finished);
+        for (int i = 0; i < 50 * buckets[b] / most; i++) {
+            putchar('#');
+        }
+        putchar('\n');
+    }
+
+    printf("\nextra moves: %.2f%% of moves, %.2f per game\n",
+            100.0 * totals.extra_moves / totals.moves, (double) totals.extra_moves / finished);
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[MAXTHREADS];
+    struct timespec start, end;
+
+    parseargs(argc, argv);
+
+    if (nthreads == 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1) {
+            nthreads = 1;
+        } else if (nthreads > MAXTHREADS) {
+            nthreads = MAXTHREADS;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int t = 0; t < nthreads; t++) {
+        if ((errno = pthread_create(&threads[t], NULL, worker, NULL)) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    return 0;
+}
+
+/*
+ * parses the seats' strategies from a comma separated list (random/greedy),
+ * the last one repeating for any seats left
+ *
+ * returns 0 on success, -1 on an unknown strategy
+ */
+int parse_strategies(char *list) {
+    char *token = strtok(list, ",");
+    int s = 0;
+
+    while (token != NULL && s < MAXSEATS) {
+        if (strcmp(token, "random") == 0) {
+            strategies[s] = RANDOM;
+        } else if (strcmp(token, "greedy") == 0) {
+            strategies[s] = GREEDY;
+        } else {
+            return -1;
+        }
+        s++;
+        token = strtok(NULL, ",");
+    }
+
+    for (; s > 0 && s < MAXSEATS; s++) {
+        strategies[s] = strategies[s - 1];
+    }
+
+    return 0;
+}
+
+/*
+ * parses the command-line arguments and error checks them
+ */
+void parseargs(int argc, char **argv) {
+    int c, status = 0;
+    while ((c = getopt(argc, argv, "g:t:n:l:s:b:")) != EOF) {
+        switch (c) {
+        case 'g':
+            ngames = strtoll(optarg, NULL, 0);
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 0);
+            break;
+        case 'n':
+            nseats = strtol(optarg, NULL, 0);
+            break;
+        case 'l':
+            late_turn = strtol(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            if (parse_strategies(optarg) == -1) {
+                status++;
+            }
+            break;
+        default:
+            status++;
+        }
+    }
+    if (ngames < 1 || nthreads < 0 || nthreads > MAXTHREADS || late_turn < 0
+            || nseats < 2 || nseats + (late_turn > 0) > MAXSEATS) {
+        status++;
+    }
+    if (status || optind != argc) {
+        fprintf(stderr, "usage: %s [-g games] [-t threads] [-n seats] [-l late join move] [-s seed] [-b strategy[,strategy...]]\n", argv[0]);
+        exit(1);
+    }
+}
@@ -2,38 +2,315 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "mancala.h"
+
+// USDT probes (provider mancsrv), e.g. for bpftrace -e 'usdt:./mancsrv:mancsrv:move { ... }';
+// their arguments are only computed while a tracer is attached (the kernel then
+// raises the probe's semaphore), and they compile to nothing without sys/sdt.h
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short mancsrv_##name##_semaphore __attribute__((unused, section(".probes")))
+#define PROBE_ENABLED(name) __builtin_expect(mancsrv_##name##_semaphore != 0, 0)
+#define PROBE2(name, a, b) do { if (PROBE_ENABLED(name)) DTRACE_PROBE2(mancsrv, name, a, b); } while (0)
+#define PROBE3(name, a, b, c) do { if (PROBE_ENABLED(name)) DTRACE_PROBE3(mancsrv, name, a, b, c); } while (0)
+#define PROBE4(name, a, b, c, d) do { if (PROBE_ENABLED(name)) DTRACE_PROBE4(mancsrv, name, a, b, c, d); } while (0)
+PROBE_SEMAPHORE(loop);
+PROBE_SEMAPHORE(move);
+PROBE_SEMAPHORE(render);
+PROBE_SEMAPHORE(message);
+PROBE_SEMAPHORE(flush);
+PROBE_SEMAPHORE(drop);
+#else
+// (sizeof does not evaluate its operand, it only keeps the arguments "used")
+#define PROBE2(name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); (void) sizeof(d); } while (0)
+#endif
+#if defined(__has_include) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT /* 6.0 headers, which also have provided buffer rings */
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #define MAXNAME 80  /* maximum permitted name size, not including \0 */
-#define NPITS 6  /* number of pits on a side, not including the end pit */
-#define NPEBBLES 4 /* initial number of pebbles per pit */
 #define MAXMESSAGE (MAXNAME + 50) /* initial number of pebbles per pit */
+#define WATCH_COMMAND "/watch" /* entered instead of a name to spectate */
+#define SPECTATOR_MAX_LAG 8 /* frames a spectator may fall behind before being dropped */
+#define MINROOMSIZE 2 /* fewest players a room can be started with */
+#define MAXROOMSIZE 6 /* most players a room can be requested with */
+#define DEFAULT_ROOM_SIZE 2 /* room size used when a player does not pick one */
+#define INITIAL_RATING 1000 /* rating of a newly connected player */
+#define RATING_K 32 /* Elo K-factor, split across a room's opponents */
+#define MATCH_INTERVAL 250 /* milliseconds between matchmaking passes */
+#define MATCH_SPREAD 100 /* rating spread allowed within a newly formed room */
+#define MATCH_SPREAD_GROWTH 50 /* extra spread allowed per second of waiting */
+#define TURN_TIMEOUT 60000 /* milliseconds a player has to make their move */
+#define TURN_MAX_SKIPS 3 /* turns in a row a player may miss before being removed */
+#define NAME_TIMEOUT 60000 /* milliseconds a new connection has to finish the handshake */
+#define IDLE_TIMEOUT 600000 /* milliseconds a queued player may stay silent */
+#define ACCEPT_BATCH 16 /* most connections accepted per loop iteration */
+#define ACCEPT_BACKOFF_MIN 100 /* milliseconds accepting pauses for after running out of resources */
+#define ACCEPT_BACKOFF_MAX 5000 /* longest (doubled) pause of accepting */
+#define TIMER_TICK 100 /* milliseconds per timer wheel tick */
+#define WHEEL_BITS 6 /* log2 of the number of slots per timer wheel level */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* timer wheel levels, covering 2^24 ticks in total */
+#define OUTBUF_MAX 65536 /* most bytes queued for a connection before it is considered dead */
+#define INBUF_MAX 65536 /* (io_uring) unread bytes of a connection at which receiving pauses */
+#define IOBUF_CHUNK 256 /* size of the pooled blocks backing small I/O buffers */
+#define POOL_MAX 64 /* most idle blocks kept in the pool */
+#if IOBUF_CHUNK < 2 * (MAXNAME + 1)
+#error "a pooled block must hold two names (see read_name)"
+#endif
+#define UPGRADE_MAGIC 0x4d414e43 /* first word of a hot upgrade handoff ("MANC") */
+#define UPGRADE_VERSION 1 /* bumped whenever the handed over state changes format */
+#define UPGRADE_FDS_PER_MSG 200 /* most fds passed per handoff message (the kernel allows 253) */
+#define UPGRADE_CHUNK 32768 /* most bytes of state per handoff message */
+#define UPGRADE_TIMEOUT 5000 /* milliseconds a hot upgrade waits for I/O to settle and the new server */
+#define NAME_BUCKETS 1024 /* initial number of buckets of the name table */
+#define INPUT_RATE 10 /* reads of input per second a player may send on average */
+#define INPUT_BURST 20 /* reads of input a player may send at once */
+#define SOURCE_INPUT_RATE 50 /* reads of input per second all players from one IP address may send */
+#define SOURCE_INPUT_BURST 100 /* reads of input all players from one IP address may send at once */
+#define SOURCE_BITS 10 /* log2 of the number of buckets of the table of source IP addresses */
+#define SOURCE_BUCKETS (1 << SOURCE_BITS)
+#define INPUT_DISCARD 4096 /* most bytes of input dropped by a single read */
+#define NOTICE_INTERVAL 1000 /* milliseconds between replies to a player's unexpected input */
+#define INPUT_STATS_INTERVAL 60000 /* milliseconds between logs of dropped input */
+#define TRACE_MAX_SPANS 1000000 /* most spans kept in memory between trace dumps */
+#define IO_MAXEVENTS 256 /* most events fetched per epoll_wait */
+#define URING_ENTRIES 1024 /* submission queue size of the io_uring backend */
+#define URING_NBUFS 1024 /* provided receive buffers of the io_uring backend (power of 2) */
+#define URING_BUFSIZE 512 /* bytes per provided receive buffer */
+#define URING_BGID 0 /* buffer group id of the provided receive buffers */
 
 int port = 57773; // port to listen on
 int listenfd; // file descriptor to listen to the connection of new players
+int reserve_fd = -1; // spare fd, given up to turn away connections when out of fds
+
+// timer data struct, linked into a slot of the timer wheel while armed
+struct timer {
+    long long expires; // tick the timer fires on
+    void (*callback)(struct timer *timer);
+    void *data;
+    struct timer *next;
+    struct timer **pprev; // link pointing at this timer, NULL if not armed
+};
+
+// growable byte buffer, holding the bytes data[off..len)
+//
+// the memory is only attached while bytes are held: small buffers use a
+// block from the shared pool, which goes back to the pool once emptied
+struct iobuf {
+    char *data; // NULL while empty
+    unsigned int off;
+    unsigned int len;
+    unsigned int cap; // IOBUF_CHUNK if data is a pooled block
+};
+
+// per-fd state of the event loop, indexed by fd
+struct fdstate {
+    unsigned watched : 1; // 1 while the event loop waits for input on the fd
+    unsigned listener : 1; // 1 if the fd is the listening socket
+    unsigned ready : 1; // 1 if input, EOF or an error is waiting this loop iteration
+    unsigned writable : 1; // 1 if the fd was reported writable this loop iteration
+    unsigned listed : 1; // 1 while in ready_fds
+    unsigned want_write : 1; // 1 while the owner waits for the fd to become writable
+    unsigned dirty : 1; // 1 while in dirty_fds
+    unsigned failed : 1; // 1 once sending failed, further Write()s then fail as well
+    unsigned send_blocked : 1; // (epoll) 1 if the last send hit a full socket buffer
+    unsigned eof : 1; // (io_uring) 1 once the peer closed or receiving failed
+    unsigned recv_paused : 1; // (io_uring) 1 while receiving waits for INBUF_MAX unread bytes to be read
+    unsigned events; // (epoll) events registered with epoll
+    unsigned gen; // (io_uring) bumped on unwatch, so stale completions can be told apart
+    int recv_errno; // (io_uring) errno of the failed receive, 0 on a clean EOF
+    struct io_req *recv_req; // (io_uring) multishot recv/accept in flight, NULL if none
+    struct io_req *poll_req; // (io_uring) POLLOUT poll in flight, NULL if none
+    struct io_req *send_req; // (io_uring) send in flight, NULL if none
+    struct iobuf in; // (io_uring) received, yet unread bytes
+    struct iobuf out; // bytes queued by Write(), not yet handed to the kernel
+};
+
+// a timed section of work, recorded while tracing (-T)
+struct span {
+    const char *name;
+    long long start; // microseconds (monotonic clock)
+    int dur; // microseconds
+    int room; // id of the room worked on, 0 for the event loop itself
+    int seat; // seat of the player worked on, -1 if none
+};
+
+// growable list of fds
+struct fdlist {
+    int *fds;
+    int len;
+    int cap;
+};
+
+// interned player name, shared by everyone referring to it
+struct name {
+    int refs;
+    unsigned int hash;
+    struct name *next; // next name in the same bucket of names
+    char str[];
+};
+
+// token bucket, refilled continuously up to its burst
+struct bucket {
+    long long stamp; // time (ms) of the last refill
+    int tokens; // thousandths of a token
+};
+
+// IP address players connect from, shared by all its connections
+struct source {
+    in_addr_t addr;
+    int refs; // number of players connected from addr
+    struct bucket input; // limits the input of all players from addr together
+    struct source *next; // next source in the same bucket of sources
+};
 
 // player data struct
 struct player {
     int fd; // file descriptor to read/write onto
-    char name[MAXNAME+1];
+    char *name; // interned (see name_intern), "" until a complete, valid name was received
+    char *partial_name; // name received so far (a pooled block), NULL if none is pending
     int pits[NPITS+1];  // pits[0..NPITS-1] are the regular pits 
                         // pits[NPITS] is the end pit
     int points;
+    int rating;
+    unsigned char named; // 1 once a complete, valid name was received
+    unsigned char size; // requested room size, 0 while not yet chosen
+    unsigned char skipped_turns; // turns in a row the player let time out
+    unsigned char dead; // 1 once writing to the player failed, until reap_dead_players() removes them
+    long long queued_at; // time (ms) the player (re-)entered the queue
+    long long noticed_at; // time (ms) the player was last replied to for unexpected input
+    struct bucket input; // limits the player's input (see player_ready)
+    struct source *source; // IP address connected from, NULL if unknown
+    struct timer timer; // name, idle or turn timer, depending on where the player is
+    struct room *room; // room the player is seated in, NULL if not playing
     struct player *next;
 };
 
-struct player *playerlist = NULL; // list of all active/valid players
+// an encoded board frame, shared by every spectator that is sending it
+struct frame {
+    int refs; // number of spectators (plus latest_frame) holding this frame
+    int seq;
+    size_t len;
+    char data[];
+};
+
+// spectator (read-only watcher) data struct
+struct spectator {
+    int fd;
+    struct frame *frame; // frame currently being sent, NULL if idle
+    size_t sent; // bytes of frame already written
+    int sent_seq; // sequence number of the newest frame this spectator has started
+    int lag; // frames published while this spectator was still mid-frame
+    int watch_room; // id of the room asked for, 0 for any room
+    struct room *room; // room being watched, NULL while waiting for one
+    struct spectator *next;
+};
+
+// room (single game session) data struct
+struct room {
+    int id;
+    int size; // number of players the room was matched for
+    struct player *playerlist; // list of all active/valid players in this room
+    struct player *current_player;
+    int next_player; // 1 if current_player must be switched
+    int prompted_next_player; // 1 if current_player was prompted for their move
+    struct spectator *spectatorlist; // list of all spectators of this room
+    struct frame *latest_frame; // most recently published board frame
+    struct frame *pending_frame; // frame waiting to be published to spectators
+    struct room *next;
+};
+
 struct player *templist = NULL; // list of all connected, yet incomplete players
+struct player *queuelist = NULL; // list of all players waiting for a room
+struct room *roomlist = NULL; // list of all rooms with a game in progress
+struct spectator *spectatorlist = NULL; // list of all spectators waiting for a room
+
+int frame_seq = 0; // sequence number of the latest published frame (across all rooms)
+int room_seq = 0; // id of the latest room created
+long long next_match = 0; // time (ms) of the next matchmaking pass
+
+struct timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS]; // hierarchical timer wheel
+long long wheel_tick = 0; // next tick of the wheel to be processed
+int wheel_count = 0; // number of armed timers
+
+struct timer accept_timer; // resumes accepting after a backoff
+int accept_backoff = ACCEPT_BACKOFF_MIN; // milliseconds of the next accept backoff
+
+enum io_backend { IO_EPOLL, IO_URING };
+enum io_backend backend = IO_EPOLL; // I/O backend driving the event loop
+int use_uring = 0; // 1 if io_uring was asked for (-u), epoll is used otherwise or as fallback
+int epfd = -1; // epoll instance of the epoll backend
+
+struct fdstate *fdtab = NULL; // state of every fd the event loop knows of
+int fdtab_size = 0;
+struct fdlist ready_fds; // fds with ready or writable set this loop iteration
+struct fdlist dirty_fds; // fds with output queued since the last io_flush()
+struct fdlist accepted_fds; // (io_uring) accepted fds, or -errno, waiting for Accept()
+char *block_pool = NULL; // idle IOBUF_CHUNK blocks, linked through their first bytes
+int block_pool_len = 0;
+
+char *trace_path = NULL; // file spans are dumped to (Chrome trace format), NULL if not tracing
+struct span *spans = NULL; // spans recorded since the last dump
+int nspans = 0;
+int spans_cap = 0;
+long long spans_dropped = 0; // spans not recorded because TRACE_MAX_SPANS was reached
+volatile sig_atomic_t dump_requested = 0; // set by SIGUSR2 (dump the trace)
+volatile sig_atomic_t quit_requested = 0; // set by SIGINT/SIGTERM while tracing (dump, then exit)
+volatile sig_atomic_t upgrade_requested = 0; // set by SIGUSR1 (hot upgrade)
+
+char **saved_argv = NULL; // arguments the server was started with, re-executed by a hot upgrade
+char *exe_path = NULL; // absolute path of the server binary, NULL if unknown (see save_exe_path)
+int upgrade_fd = -1; // (-U) socket the previous server hands over on, -1 if started afresh
+
+struct name **names = NULL; // interned player names, chained per bucket
+int names_size = 0; // number of buckets, a power of 2
+int names_count = 0;
+
+struct source *sources[SOURCE_BUCKETS]; // source IP addresses of all players, chained per bucket
+long long dropped_reads = 0; // reads of input dropped by the rate limits since the last log
+long long dropped_bytes = 0;
+long long suppressed_notices = 0; // replies to unexpected input suppressed since the last log
+struct timer stats_timer; // logs the dropped input, armed while there is any
 
 extern void parseargs(int argc, char **argv);
 extern void makelistener();
-extern int compute_average_pebbles();
-extern int game_is_over();  /* boolean */
-extern void broadcast(char *s);  /* you need to write this one */
+extern int compute_average_pebbles(struct room *room);
+extern int game_is_over(struct room *room);  /* boolean */
+extern void broadcast(struct room *room, char *s);  /* you need to write this one */
+extern void name_timeout(struct timer *timer);
+extern void idle_timeout(struct timer *timer);
+extern void turn_timeout(struct timer *timer);
+extern void resume_accept(struct timer *timer);
+extern void Close(int fd);
+extern long long now_ms();
+extern void handle_player_creation();
+extern void log_dropped_input(struct timer *timer);
 
 /*
  * Error-checking wrapper function for malloc
@@ -52,17 +329,15 @@ void *Malloc(size_t size) {
 }
 
 /*
- * Error-checking wrapper function for accept
+ * Error-checking wrapper function for realloc
  *
- * returns the new file descriptor returned by accept
- * to read/write on
+ * returns the new pointer returned by realloc
  */
-int Accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-    int return_value;
+void *Realloc(void *ptr, size_t size) {
+    void *return_value;
 
-    if ((return_value = accept(sockfd, addr, addrlen)) < 0) {
-        perror("accept");
-        close(sockfd);
+    if ((return_value = realloc(ptr, size)) == NULL) {
+        perror("realloc");
         exit(1);
     }
 
@@ -70,705 +345,4304 @@ int Accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
 }
 
 /*
- * Error-checking wrapper function for close
+ * returns the current time in microseconds (monotonic clock)
  */
-void Close(int fd) {
-    if (close(fd) == -1) {
-        perror("close");
-        exit(1);
-    }
+long long now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /*
- * Error-checking wrapper function for read
- *
- * returns the amount of bytes read
+ * returns the start time of a span to be recorded with trace_end(),
+ * 0 if not tracing
  */
-ssize_t Read(int fd, void *buf, size_t count) {
-    ssize_t return_value;
-    
-    if ((return_value = read(fd, buf, count)) == -1) {
-        perror("read");
-        Close(fd);
-        exit(1);
+long long trace_begin() {
+    return trace_path != NULL ? now_us() : 0;
+}
+
+/*
+ * records the span name, started at start (see trace_begin) for room and seat
+ */
+void trace_end(const char *name, long long start, int room, int seat) {
+    struct span *span;
+
+    if (start == 0) {
+        return;
     }
 
-    return return_value;
+    if (nspans == TRACE_MAX_SPANS) {
+        spans_dropped++;
+        return;
+    }
+
+    if (nspans == spans_cap) {
+        spans_cap = spans_cap ? spans_cap * 2 : 4096;
+        spans = Realloc(spans, spans_cap * sizeof(struct span));
+    }
+
+    span = &spans[nspans++];
+    span->name = name;
+    span->start = start;
+    span->dur = now_us() - start;
+    span->room = room;
+    span->seat = seat;
 }
 
 /*
- * Error-checking wrapper function for write
+ * writes the recorded spans in Chrome trace format (one thread lane per room,
+ * the event loop being "room" 0) and forgets them
  *
- * returns the amount of bytes written
+ * the final dump goes to trace_path, the ones before to trace_path.1, .2, ...
  */
-int Write(int fd, const void *buf, size_t count) {
-    int write_return;
-    
-    if ((write_return = write(fd, buf, count)) != count) {
-        perror("write");
-        Close(fd);
-        exit(1);
+void trace_dump(int final) {
+    static int ndumps = 0;
+    char path[strlen(trace_path) + 16];
+    FILE *file;
+
+    if (final) {
+        snprintf(path, sizeof(path), "%s", trace_path);
+    } else {
+        snprintf(path, sizeof(path), "%s.%d", trace_path, ++ndumps);
+    }
+
+    if ((file = fopen(path, "w")) == NULL) {
+        perror("fopen");
+        return;
     }
 
-    return write_return;
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (int i = 0; i < nspans; i++) {
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%d,\"pid\":%d,\"tid\":%d",
+                spans[i].name, spans[i].start, spans[i].dur, (int) getpid(), spans[i].room);
+        if (spans[i].seat >= 0) {
+            fprintf(file, ",\"args\":{\"seat\":%d}", spans[i].seat);
+        }
+        fprintf(file, "}%s\n", i + 1 < nspans ? "," : "");
+    }
+    fprintf(file, "],\"otherData\":{\"dropped_spans\":%lld}}\n", spans_dropped);
+
+    if (fclose(file) == EOF) {
+        perror("fclose");
+    }
+
+    printf("Dumped %d trace spans to %s\n", nspans, path);
+    nspans = 0;
+    spans_dropped = 0;
 }
 
 /*
- * Error-checking wrapper function for select
+ * signal handler while tracing: SIGUSR2 asks for a dump, SIGINT/SIGTERM
+ * for a dump and exit (both done by the main loop)
  */
-void Select(int n_fds, fd_set *r_fds, fd_set *w_fds, fd_set *e_fds, struct timeval *timeout) {
-    if (select (n_fds, r_fds, w_fds, e_fds, timeout) == -1) {
-        perror("select");
-        exit(1);
+void trace_signal(int sig) {
+    if (sig == SIGUSR2) {
+        dump_requested = 1;
+    } else {
+        quit_requested = 1;
     }
 }
 
 /*
- * returns the last player in the list pointed by **list
- *
- * if the list is empty/NULL, returns NULL
+ * appends fd to list
  */
-struct player *get_newest_player(struct player **list) {
-    struct player *newest_player = *list;
-    
-    if (newest_player != NULL) {
-        while (newest_player->next != NULL) {
-            newest_player = newest_player->next;
-        }
+void fdlist_push(struct fdlist *list, int fd) {
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->fds = Realloc(list->fds, list->cap * sizeof(int));
     }
 
-    return newest_player;
+    list->fds[list->len++] = fd;
 }
 
 /*
- * checks to see if the input name already exists within playerlist.
- * If so, returns 1, otherwise 0;
+ * returns the number of bytes held by buf
  */
-int name_valid(char *name) {
-    int name_len = strlen(name);
-    int player_name_len;
-    int longer_str;
-    
-    if (strlen(name) == 0) {
-        return 0;
-    }
-    
-    for (struct player *p = playerlist; p; p = p->next) {
-        player_name_len = strlen(p->name);
-        
-        // use the longer string to compare
-        if (name_len > player_name_len) {
-            longer_str = name_len;
-        } else {
-            longer_str = player_name_len;
-        }
+size_t iobuf_pending(struct iobuf *buf) {
+    return buf->len - buf->off;
+}
 
-        if (strncmp(p->name, name, longer_str) == 0) {
-            return 0;
-        }
+/*
+ * returns an IOBUF_CHUNK block, from the pool if it has any
+ */
+char *block_get() {
+    char *block = block_pool;
+
+    if (block == NULL) {
+        return Malloc(IOBUF_CHUNK);
     }
-    
-    return 1;
+
+    memcpy(&block_pool, block, sizeof(char *));
+    block_pool_len--;
+
+    return block;
 }
 
 /*
- * displays the state of all the game boards to all players in playerlist
+ * returns an IOBUF_CHUNK block to the pool (or frees it, if the pool is full)
  */
-void show_boards() {
-    char buffer[MAXMESSAGE + 1];
-    char temp[MAXMESSAGE + 1];
-
-    printf("Displaying boards to players\n");
+void block_put(char *block) {
+    if (block_pool_len == POOL_MAX) {
+        free(block);
+        return;
+    }
 
-    for (struct player *p = playerlist; p; p = p->next) {
-        // reset buffer and temp everytime as a security feature
-        memset(buffer, '\0', MAXMESSAGE + 1);
+    memcpy(block, &block_pool, sizeof(char *));
+    block_pool = block;
+    block_pool_len++;
+}
 
-        for (int i = 0; i <= NPITS; i++) {
-            memset(temp, '\0', MAXMESSAGE + 1);
-            if (i < NPITS) {
-                if (i == 0) {
-                    sprintf(temp, "%s: [0]%d ", p->name, p->pits[0]);
-                } else {
-                    sprintf(temp, "[%d]%d ", i, p->pits[i]);
-                }
-            } else {
-                sprintf(temp, "[end pit]%d\r\n", p->pits[i]);
-            }
-            strcat(buffer, temp);
-        }
-        
-        broadcast(buffer);
+/*
+ * frees the memory held by buf and empties it
+ */
+void iobuf_free(struct iobuf *buf) {
+    if (buf->cap == IOBUF_CHUNK) {
+        block_put(buf->data);
+    } else {
+        free(buf->data);
     }
+    memset(buf, 0, sizeof(struct iobuf));
 }
 
 /*
- * removes a player in list and replaces them with the next player.
- * If the player leaving is the only one, then playerlist is set to NULL
- * 
- * Uses pointers to pointers to make sure old_playe and list are kept updated
+ * appends count bytes of data to buf, growing it as needed
  */
-void remove_player(struct player **old_player, struct player **list) {
-    char msg[MAXMESSAGE + 1];
-    int old_fd = (*old_player)->fd;
-    char *old_name = (*old_player)->name;
-    struct player *free_value = *old_player;
-    
-    // only close here if list == &playerlist since timing of fd use differs
-    // in both cases
-    if (list == &playerlist) {
-        Close(old_fd);
+void iobuf_append(struct iobuf *buf, const char *data, size_t count) {
+    char *grown;
+    size_t cap, len;
 
-        memset(msg, '\0', MAXMESSAGE + 1);
+    // reuse the consumed space at the front before growing
+    if (buf->len + count > buf->cap && buf->off > 0) {
+        memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+        buf->len -= buf->off;
+        buf->off = 0;
     }
 
-    // if old_player is the first player...
-    if ((*list)->fd == old_fd) {
-        *list = (*list)->next;
-        *old_player = (*list);
-    } else {
-        for (struct player **p = list; *p; p = &((*p)->next)) {
-            // once the player before old_player is found...
-            if ((*p)->next->fd == old_fd) { 
-                (*p)->next = (*p)->next->next;
-                
-                // if the player that disconnected was the last one in playerlist...
-                if ((*p)->next == NULL) {
-                    *old_player = *list;
-                } else {
-                    *old_player = (*p)->next;
-                }
-                
-                break;
-            }
+    if (buf->len + count > buf->cap) {
+        cap = buf->cap ? buf->cap * 2 : IOBUF_CHUNK;
+        while (buf->len + count > cap) {
+            cap *= 2;
         }
-    }
-    
-    // when an incomplete player disconnects, active players do not need to be notified    
-    if (list == &playerlist) {
-        printf("%s has left the game.\n", old_name);
-    
-        if (playerlist != NULL) {
-            if (playerlist->next != NULL) {
-                sprintf(msg, "%s has left the game.\r\n", old_name);
-            } else {
-                sprintf(msg, "%s has left the game. Waiting for more players...\r\n", old_name);
-            }
-        
-            broadcast(msg);
-            show_boards();
-        } else {
-            printf("All players have left. Waiting for more players...\n");
+
+        // only IOBUF_CHUNK sized buffers come from the pool
+        grown = cap == IOBUF_CHUNK ? block_get() : Malloc(cap);
+        len = buf->len;
+        if (len > 0) {
+            memcpy(grown, buf->data, len);
         }
+
+        iobuf_free(buf);
+        buf->data = grown;
+        buf->len = len;
+        buf->cap = cap;
     }
 
-    // free at the end so that player names can still be printed
-    free(free_value);    
+    memcpy(buf->data + buf->len, data, count);
+    buf->len += count;
 }
 
 /*
- * adds a dynamic memory-allocated struct player to the end of list
+ * drops the first count bytes of buf, detaching its memory once it is empty
  */
-void add_new_player(int fd, char *name, struct player **list) {
-    int num_pebbles = compute_average_pebbles();
-    struct player *new_player = Malloc(sizeof(struct player));
-    struct player *last_player = get_newest_player(list);
-    
-    new_player->fd = fd;
-    memset(new_player->name, '\0', MAXNAME + 1);
-    strncpy(new_player->name, name, MAXNAME);
-    new_player->next = NULL;
-    
-    for (int i = 0; i < 6; i++) {
-        new_player->pits[i] = num_pebbles;
-    }
-    
-    // if this is the first player for list...
-    if (last_player == NULL) {
-        *list = new_player;
-    } else {
-        last_player->next = new_player;
+void iobuf_consume(struct iobuf *buf, size_t count) {
+    buf->off += count;
+
+    if (buf->off == buf->len) {
+        iobuf_free(buf);
     }
 }
+
 /*
- * removes newline characters and null-terminates the string
- *
- * does so regardless of the format of the newline
- *
- * returns 1 if the string was properly null-terminated,
- * returns 0 otherwise (input was incomplete)
+ * returns the event loop state of fd, growing fdtab as needed
  */
-int null_terminate(char *string, int size) {
-    for (int i = 0; i < size; i++) {
-        if (string[i] == '\r' || string[i] == '\n') {
-            string[i] = '\0';
-            return 1;
+struct fdstate *fd_state(int fd) {
+    if (fd >= fdtab_size) {
+        int new_size = fdtab_size ? fdtab_size : 64;
+
+        while (new_size <= fd) {
+            new_size *= 2;
         }
+
+        fdtab = Realloc(fdtab, new_size * sizeof(struct fdstate));
+        memset(fdtab + fdtab_size, 0, (new_size - fdtab_size) * sizeof(struct fdstate));
+        fdtab_size = new_size;
     }
 
-    return 0;
+    return &fdtab[fd];
 }
 
 /*
- * reads input from a player and null terminates it 
+ * puts fd into ready_fds, so its ready/writable flags get cleared by the next io_wait()
  */
-int read_input(int player_fd, char *input, int max_input) {
-    int read_return = Read(player_fd, input, max_input);
-
-    null_terminate(input, max_input);
+void list_ready(int fd) {
+    struct fdstate *st = fd_state(fd);
 
-    return read_return;
+    if (!st->listed) {
+        st->listed = 1;
+        fdlist_push(&ready_fds, fd);
+    }
 }
 
 /*
- * reads name from a player and null-terminates it
- * 
- * returns 1 if a complete name was received, 0 if not,
- * and -1 if the player disconnected (before completing name)
+ * marks fd as having input (or EOF/an error) to be handled this loop iteration
  */
-int read_name(int player_fd, char *player_name, fd_set *all_fds) {
-    char partial_name[MAXNAME + 1];
-    char msg[MAXMESSAGE + 1];
-    int remaining_space = MAXNAME - strlen(player_name);
-    int return_value = 0;
+void mark_ready(int fd) {
+    fd_state(fd)->ready = 1;
+    list_ready(fd);
+}
 
-    memset(partial_name, '\0', MAXNAME + 1);
+/*
+ * remembers that fd has output to be sent by the next io_flush()
+ */
+void mark_dirty(int fd) {
+    struct fdstate *st = fd_state(fd);
 
-    // if the player disconnects...
-    if (Read(player_fd, partial_name, MAXNAME) == 0) {
-        Close(player_fd);
-        FD_CLR(player_fd, all_fds);
-        
-        return -1;
+    if (!st->dirty) {
+        st->dirty = 1;
+        fdlist_push(&dirty_fds, fd);
     }
+}
 
-    return_value = null_terminate(partial_name, MAXNAME);
-    
-    strncat(player_name, partial_name, remaining_space);
+/*
+ * (re-)registers fd with epoll for input, and for output while anything waits for it
+ */
+void epoll_update(int fd) {
+    struct fdstate *st = fd_state(fd);
+    struct epoll_event ev;
 
-    // if the name is complete and the name is invalid
-    if (return_value == 1 && !name_valid(player_name)) {
-        memset(msg, '\0', MAXNAME + 1);
-        sprintf(msg, "That name is already invalid. Must not be blank and must not match any other\r\n");
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (st->want_write || st->send_blocked) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+
+    if (ev.events != st->events) {
+        if (epoll_ctl(epfd, st->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+        }
+        st->events = ev.events;
+    }
+}
 
+/*
+ * sends as much of the output queued for fd as its socket buffer takes
+ */
+void epoll_send(int fd) {
+    struct fdstate *st = fd_state(fd);
+    ssize_t sent = send(fd, st->out.data + st->out.off, iobuf_pending(&st->out),
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
 
-        printf("Player input an invalid name: %s. Prompting for a new name\n", player_name);
-        Write(player_fd, msg, strlen(msg)); 
-        
-        memset(player_name, '\0', MAXNAME);
-        return_value = 0;
+    if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            st->send_blocked = 1;
+        } else {
+            perror("send");
+            st->failed = 1;
+            st->send_blocked = 0;
+            iobuf_free(&st->out);
+        }
+    } else {
+        iobuf_consume(&st->out, sent);
+        st->send_blocked = iobuf_pending(&st->out) > 0;
     }
 
-    return return_value;
+    if (st->watched) {
+        epoll_update(fd);
+    }
 }
 
 /*
- * Writes a message to the indicated player.
- * 
- * If the player has disconnected, the player is removed
+ * waits up to timeout_ms (-1 for no limit) for epoll events and flags the fds they are for
  */
-void notify_player(struct player **player, char *msg, int size) {
-    char buffer[size + 1];
+void epoll_wait_events(long long timeout_ms) {
+    struct epoll_event events[IO_MAXEVENTS];
+    int n_events;
 
-    memset(buffer, '\0', size + 1);
-    strncpy(buffer, msg, size);
+    if ((n_events = epoll_wait(epfd, events, IO_MAXEVENTS, (int) timeout_ms)) == -1) {
+        if (errno != EINTR) {
+            perror("epoll_wait");
+        }
+        return;
+    }
 
-    if (Write((*player)->fd, buffer, strlen(msg)) != strlen(msg)) {
-        remove_player(player, &playerlist);
+    for (int i = 0; i < n_events; i++) {
+        int fd = events[i].data.fd;
+        struct fdstate *st = fd_state(fd);
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            mark_ready(fd);
+        }
+
+        if (events[i].events & EPOLLOUT) {
+            st->writable = 1;
+            list_ready(fd);
+
+            if (st->send_blocked) {
+                st->send_blocked = 0;
+                mark_dirty(fd);
+            }
+        }
     }
 }
 
+#ifdef HAVE_IO_URING
+enum { REQ_ACCEPT, REQ_RECV, REQ_SEND, REQ_POLLOUT };
+
+// io_uring request, passed as user_data and freed once its last completion arrives
+struct io_req {
+    int op; // REQ_*
+    int fd;
+    unsigned gen; // fdstate gen of fd at submission
+    struct iobuf buf; // (REQ_SEND) bytes being sent, owned by the request
+    struct iobuf tail; // (REQ_SEND) bytes left queued by Close(), sent after buf
+    int closing; // (REQ_SEND) 1 once fd was Close()d, it is closed when the request is done
+};
+
+// io_uring instance with its mapped rings and provided receive buffers
+struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs; // URING_NBUFS buffers of URING_BUFSIZE bytes
+    unsigned short buf_tail;
+} ring;
+
+int uring_inflight = 0; // requests submitted and not yet freed
+int uring_quiescing = 0; // 1 while no request is to be (re-)submitted (see uring_quiesce)
+int uring_closing = 0; // sends in flight for fds already Close()d (see Close)
+
 /*
- * notifies all players except the indicated player
- * 
- * uses a pointer to a pointer to accommodate other functions
+ * hands receive buffer bid (back) to the kernel
  */
-void notify_all_other_players(struct player **excluded_player, char *msg, int size) {
-    for (struct player *p = playerlist; p; p = p->next) {
-        if (p->fd != (*excluded_player)->fd) {
-            notify_player(&p, msg, size);
-        }
+void uring_provide_buffer(unsigned short bid) {
+    struct io_uring_buf *buf = &ring.buf_ring->bufs[ring.buf_tail & (URING_NBUFS - 1)];
+
+    buf->addr = (unsigned long) (ring.bufs + bid * URING_BUFSIZE);
+    buf->len = URING_BUFSIZE;
+    buf->bid = bid;
+    ring.buf_tail++;
+
+    __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * returns a zeroed submission queue entry, submitted by the next io_uring_enter
+ *
+ * the entry is published right away; that is fine as the kernel only
+ * looks at the queue during io_uring_enter
+ */
+struct io_uring_sqe *uring_get_sqe() {
+    unsigned tail = *ring.sq_tail;
+    unsigned index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        // the queue is full, so submit what is there
+        if (syscall(__NR_io_uring_enter, ring.fd, ring.sq_entries, 0, 0, NULL, 0) == -1) {
+            perror("io_uring_enter");
+        }
+    }
+
+    index = tail & *ring.sq_mask;
+    sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/*
+ * returns a new request of type op for fd
+ */
+struct io_req *uring_new_req(int op, int fd) {
+    struct io_req *req = Malloc(sizeof(struct io_req));
+
+    memset(req, 0, sizeof(struct io_req));
+    req->op = op;
+    req->fd = fd;
+    req->gen = fd_state(fd)->gen;
+    uring_inflight++;
+
+    return req;
+}
+
+/*
+ * frees req (and the bytes it was sending) once its last completion arrived
+ */
+void uring_free_req(struct io_req *req) {
+    iobuf_free(&req->buf);
+    iobuf_free(&req->tail);
+    if (req->closing) {
+        uring_closing--;
+    }
+    free(req);
+    uring_inflight--;
+}
+
+/*
+ * submits a multishot accept (listener) or multishot recv for fd
+ */
+void uring_arm_recv(int fd) {
+    struct fdstate *st = fd_state(fd);
+    struct io_req *req = uring_new_req(st->listener ? REQ_ACCEPT : REQ_RECV, fd);
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    sqe->fd = fd;
+    if (st->listener) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+    } else {
+        // received data lands in a provided buffer, picked by the kernel
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+    }
+    sqe->user_data = (unsigned long) req;
+
+    st->recv_req = req;
+}
+
+/*
+ * (re-)arms the recv of fd, unless it is not watched (anymore), at EOF,
+ * being quiesced or already armed.
+ *
+ * while INBUF_MAX bytes are still unread, receiving is paused instead, until
+ * Read() drains them, so a peer sending faster than it is read is held back
+ * by TCP flow control rather than buffered here
+ */
+void uring_rearm_recv(int fd) {
+    struct fdstate *st = fd_state(fd);
+
+    if (!st->watched || st->eof || uring_quiescing || st->recv_req != NULL) {
+        return;
+    }
+
+    if (iobuf_pending(&st->in) >= INBUF_MAX) {
+        st->recv_paused = 1;
+        return;
+    }
+
+    st->recv_paused = 0;
+    uring_arm_recv(fd);
+}
+
+/*
+ * submits the cancellation of the request req
+ */
+void uring_cancel(struct io_req *req) {
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) req;
+    sqe->user_data = 0;
+}
+
+/*
+ * submits a send of the bytes left in req->buf
+ */
+void uring_submit_send(struct io_req *req) {
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = req->fd;
+    sqe->addr = (unsigned long) (req->buf.data + req->buf.off);
+    sqe->len = iobuf_pending(&req->buf);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long) req;
+}
+
+/*
+ * hands the output queued for fd over to a send request, unless one is in flight
+ */
+void uring_send(int fd) {
+    struct fdstate *st = fd_state(fd);
+    struct io_req *req;
+
+    if (st->send_req != NULL || st->failed || iobuf_pending(&st->out) == 0 || uring_quiescing) {
+        return;
+    }
+
+    // the request takes over the buffer, Write() starts a new one meanwhile
+    req = uring_new_req(REQ_SEND, fd);
+    req->buf = st->out;
+    memset(&st->out, 0, sizeof(struct iobuf));
+
+    uring_submit_send(req);
+    st->send_req = req;
+}
+
+/*
+ * submits a one-shot poll for fd becoming writable
+ */
+void uring_poll_out(int fd) {
+    struct fdstate *st = fd_state(fd);
+    struct io_req *req;
+    struct io_uring_sqe *sqe;
+
+    if (st->poll_req != NULL) {
+        return;
+    }
+
+    req = uring_new_req(REQ_POLLOUT, fd);
+    sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (unsigned long) req;
+
+    st->poll_req = req;
+}
+
+/*
+ * handles the completion cqe
+ *
+ * completions of requests submitted before the fd was unwatched (stale
+ * gen) only free the request; the fd may already belong to someone else
+ */
+void uring_complete(struct io_uring_cqe *cqe) {
+    struct io_req *req = (struct io_req *) (unsigned long) cqe->user_data;
+    struct fdstate *st;
+    int current;
+    int more;
+
+    // cancellations carry no request
+    if (req == NULL) {
+        return;
+    }
+
+    st = fd_state(req->fd);
+    current = req->gen == st->gen;
+    more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (req->op) {
+    case REQ_ACCEPT:
+        // accepted connections are queued even when stale, so they get closed or served
+        if (cqe->res >= 0) {
+            fdlist_push(&accepted_fds, cqe->res);
+        } else if (current && cqe->res != -ECANCELED) {
+            fdlist_push(&accepted_fds, cqe->res);
+        }
+
+        if (current && accepted_fds.len > 0) {
+            mark_ready(req->fd);
+        }
+
+        if (!more) {
+            if (current) {
+                st->recv_req = NULL;
+            }
+            if (current && st->watched && !uring_quiescing) {
+                uring_arm_recv(req->fd);
+            }
+            uring_free_req(req);
+        }
+        break;
+
+    case REQ_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (current && cqe->res > 0) {
+                iobuf_append(&st->in, ring.bufs + bid * URING_BUFSIZE, cqe->res);
+            }
+            uring_provide_buffer(bid);
+        }
+
+        // running out of buffers or being cancelled (see uring_quiesce) is no EOF
+        if (current && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            if (cqe->res == 0) {
+                st->eof = 1;
+            } else if (cqe->res < 0) {
+                st->eof = 1;
+                st->recv_errno = -cqe->res;
+            }
+            mark_ready(req->fd);
+        }
+
+        // too much unread input, stop receiving (see uring_rearm_recv)
+        if (current && more && !st->recv_paused && iobuf_pending(&st->in) >= INBUF_MAX) {
+            st->recv_paused = 1;
+            uring_cancel(req);
+        }
+
+        // the recv stops on EOF/errors, when out of buffers or when paused;
+        // resubmit in the latter cases
+        if (!more) {
+            if (current) {
+                st->recv_req = NULL;
+                uring_rearm_recv(req->fd);
+            }
+            uring_free_req(req);
+        }
+        break;
+
+    case REQ_SEND:
+        // the fd was Close()d meanwhile: finish sending, including what
+        // was still queued, then close it (see Close)
+        if (req->closing) {
+            if (cqe->res >= 0 && cqe->res < iobuf_pending(&req->buf)) {
+                iobuf_consume(&req->buf, cqe->res);
+                uring_submit_send(req);
+                return;
+            }
+            if (cqe->res >= 0 && iobuf_pending(&req->tail) > 0) {
+                iobuf_free(&req->buf);
+                req->buf = req->tail;
+                memset(&req->tail, 0, sizeof(struct iobuf));
+                uring_submit_send(req);
+                return;
+            }
+
+            if (close(req->fd) == -1) {
+                perror("close");
+            }
+            uring_free_req(req);
+            break;
+        }
+
+        if (current) {
+            if (cqe->res > 0) {
+                iobuf_consume(&req->buf, cqe->res);
+            }
+
+            if (cqe->res < 0 && cqe->res != -ECANCELED) {
+                errno = -cqe->res;
+                perror("send");
+                st->failed = 1;
+            } else if (iobuf_pending(&req->buf) > 0 && !uring_quiescing) {
+                // partial send, keep the request going with the rest
+                uring_submit_send(req);
+                return;
+            } else if (iobuf_pending(&req->buf) > 0) {
+                // cancelled by uring_quiesce: the rest goes back in front of the queued output
+                iobuf_append(&req->buf, st->out.data + st->out.off, iobuf_pending(&st->out));
+                iobuf_free(&st->out);
+                st->out = req->buf;
+                memset(&req->buf, 0, sizeof(struct iobuf));
+            }
+
+            st->send_req = NULL;
+            uring_send(req->fd);
+        }
+
+        uring_free_req(req);
+        break;
+
+    case REQ_POLLOUT:
+        if (current) {
+            st->poll_req = NULL;
+            if (cqe->res != -ECANCELED) {
+                st->writable = 1;
+                list_ready(req->fd);
+            }
+        }
+
+        uring_free_req(req);
+        break;
+    }
+}
+
+/*
+ * submits everything queued, waits up to timeout_ms (-1 for no limit)
+ * for a completion and handles all completions there are, in a single
+ * io_uring_enter
+ */
+void uring_wait(long long timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned head;
+    unsigned tail;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        arg.ts = (unsigned long) &ts;
+    }
+
+    if (syscall(__NR_io_uring_enter, ring.fd, to_submit, timeout_ms == 0 ? 0 : 1,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1) {
+        if (errno != ETIME && errno != EINTR) {
+            perror("io_uring_enter");
+        }
+    }
+
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        uring_complete(&ring.cqes[head & *ring.cq_mask]);
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * cancels every recv, accept, poll and send in flight and waits (up to
+ * timeout_ms) for all of them to complete, so that everything received so
+ * far is in the input buffers, everything not sent yet is in the output
+ * buffers, and nothing is received or sent behind our back
+ *
+ * sends of fds that were already Close()d are not waited for
+ *
+ * returns 0 once no request is in flight, -1 on timeout
+ */
+int uring_quiesce(long long timeout_ms) {
+    long long deadline = now_ms() + timeout_ms;
+
+    uring_quiescing = 1;
+
+    for (int fd = 0; fd < fdtab_size; fd++) {
+        if (fdtab[fd].recv_req != NULL) {
+            uring_cancel(fdtab[fd].recv_req);
+        }
+        if (fdtab[fd].poll_req != NULL) {
+            uring_cancel(fdtab[fd].poll_req);
+        }
+        if (fdtab[fd].send_req != NULL) {
+            uring_cancel(fdtab[fd].send_req);
+        }
+    }
+
+    while (uring_inflight > uring_closing && now_ms() < deadline) {
+        uring_wait(deadline - now_ms());
+    }
+
+    if (uring_inflight == uring_closing) {
+        return 0;
+    }
+
+    for (int fd = 0; fd < fdtab_size; fd++) {
+        struct fdstate *st = &fdtab[fd];
+
+        if (st->recv_req != NULL || st->poll_req != NULL || st->send_req != NULL) {
+            printf("fd %d still has a%s%s%s in flight\n", fd, st->recv_req != NULL ? " recv" : "",
+                    st->poll_req != NULL ? " poll" : "", st->send_req != NULL ? " send" : "");
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * re-arms the recvs, accepts and polls stopped by uring_quiesce
+ */
+void uring_resume() {
+    uring_quiescing = 0;
+
+    for (int fd = 0; fd < fdtab_size; fd++) {
+        struct fdstate *st = &fdtab[fd];
+
+        uring_rearm_recv(fd);
+        if (st->watched && st->want_write) {
+            uring_poll_out(fd);
+        }
+        if (iobuf_pending(&st->out) > 0) {
+            mark_dirty(fd);
+        }
+    }
+}
+#endif
+
+/*
+ * starts watching fd for input
+ */
+void io_watch(int fd) {
+    struct fdstate *st = fd_state(fd);
+
+    if (st->watched) {
+        return;
+    }
+    st->watched = 1;
+
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING) {
+        // while quiescing, the recv is armed by uring_resume
+        uring_rearm_recv(fd);
+        return;
+    }
+#endif
+    epoll_update(fd);
+}
+
+/*
+ * starts watching the listening socket fd for new connections
+ */
+void io_watch_listener(int fd) {
+    fd_state(fd)->listener = 1;
+    io_watch(fd);
+}
+
+/*
+ * stops watching fd; input already received for it is dropped
+ */
+void io_unwatch(int fd) {
+    struct fdstate *st = fd_state(fd);
+
+    if (!st->watched) {
+        return;
+    }
+    st->watched = 0;
+    st->ready = 0;
+    st->writable = 0;
+    st->want_write = 0;
+
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING) {
+        if (st->recv_req != NULL) {
+            uring_cancel(st->recv_req);
+        }
+        if (st->poll_req != NULL) {
+            uring_cancel(st->poll_req);
+        }
+        st->recv_req = NULL;
+        st->poll_req = NULL;
+        st->send_req = NULL;
+        st->eof = 0;
+        st->recv_paused = 0;
+        st->recv_errno = 0;
+        st->gen++;
+        iobuf_free(&st->in);
+        return;
+    }
+#endif
+    iobuf_free(&st->in);
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+    st->events = 0;
+    st->send_blocked = 0;
+}
+
+/*
+ * sets whether the next io_wait() should report fd becoming writable
+ */
+void io_want_write(int fd, int on) {
+    struct fdstate *st = fd_state(fd);
+
+    st->want_write = on;
+
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING) {
+        if (on && !uring_quiescing) {
+            uring_poll_out(fd);
+        }
+        return;
+    }
+#endif
+    epoll_update(fd);
+}
+
+/*
+ * returns 1 if fd has input, EOF or an error to be handled this loop iteration
+ */
+int io_ready(int fd) {
+    return fd < fdtab_size && fdtab[fd].ready;
+}
+
+/*
+ * returns 1 if fd was reported writable this loop iteration
+ */
+int io_writable(int fd) {
+    return fd < fdtab_size && fdtab[fd].writable;
+}
+
+/*
+ * hands all output queued by Write() since the last call to the kernel
+ */
+void io_flush() {
+    long long start = trace_begin();
+
+    for (int i = 0; i < dirty_fds.len; i++) {
+        int fd = dirty_fds.fds[i];
+        struct fdstate *st = fd_state(fd);
+
+        st->dirty = 0;
+        if (st->failed || iobuf_pending(&st->out) == 0) {
+            continue;
+        }
+
+        PROBE2(flush, fd, iobuf_pending(&st->out));
+
+#ifdef HAVE_IO_URING
+        if (backend == IO_URING) {
+            uring_send(fd);
+            continue;
+        }
+#endif
+        epoll_send(fd);
+    }
+
+    trace_end("flush", start, 0, -1);
+    dirty_fds.len = 0;
+}
+
+/*
+ * waits up to timeout_ms (-1 for no limit) for any watched fd to become
+ * ready, clearing the readiness of the previous loop iteration first
+ */
+void io_wait(long long timeout_ms) {
+    int n_listed = ready_fds.len;
+
+    ready_fds.len = 0;
+    for (int i = 0; i < n_listed; i++) {
+        struct fdstate *st = fd_state(ready_fds.fds[i]);
+
+        st->ready = 0;
+        st->writable = 0;
+        st->listed = 0;
+    }
+
+    // input that was received but not read yet keeps its fd ready
+    // (such an fd was ready last iteration, so only those are checked;
+    // ready_fds is refilled in place, never past the entry being read)
+    for (int i = 0; i < n_listed; i++) {
+        int fd = ready_fds.fds[i];
+        struct fdstate *st = &fdtab[fd];
+
+        if (st->watched && (iobuf_pending(&st->in) > 0 || st->eof
+                            || (st->listener && accepted_fds.len > 0))) {
+            mark_ready(fd);
+            timeout_ms = 0;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING) {
+        uring_wait(timeout_ms);
+        return;
+    }
+#endif
+    epoll_wait_events(timeout_ms);
+}
+
+/*
+ * stops all I/O the backend does in the background (io_uring recvs, accepts
+ * and polls), so that every byte received so far is in the fds' input buffers
+ *
+ * returns 0 on success, -1 if I/O was still in flight after timeout_ms
+ */
+int io_quiesce(long long timeout_ms) {
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING) {
+        return uring_quiesce(timeout_ms);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * restarts the I/O stopped by io_quiesce
+ */
+void io_resume() {
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING) {
+        uring_resume();
+    }
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * sets up the io_uring backend: the rings, the provided receive buffers,
+ * and a check that the kernel supports multishot recv on sockets
+ *
+ * returns 0 on success, -1 if io_uring can not be used
+ */
+int uring_init() {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t ring_size = 0;
+    char *sq = MAP_FAILED;
+    int sv[2];
+    int works;
+
+    ring.sqes = MAP_FAILED;
+    ring.buf_ring = MAP_FAILED;
+    ring.bufs = NULL;
+
+    memset(&params, 0, sizeof(params));
+    if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        goto fail;
+    }
+
+    // the submission and completion rings share one mapping
+    ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring_size) {
+        ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    sq = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring.sq_entries = params.sq_entries;
+    ring.cq_head = (unsigned *) (sq + params.cq_off.head);
+    ring.cq_tail = (unsigned *) (sq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *) (sq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (sq + params.cq_off.cqes);
+
+    // provided buffer ring, the kernel picks a buffer per received chunk
+    ring.buf_ring = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring.buf_ring == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring.buf_ring;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register");
+        goto fail;
+    }
+
+    ring.bufs = Malloc(URING_NBUFS * URING_BUFSIZE);
+    for (int i = 0; i < URING_NBUFS; i++) {
+        uring_provide_buffer(i);
+    }
+
+    // multishot recv (Linux 6.0+) must keep delivering, so try it on a socketpair
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        goto fail;
+    }
+
+    backend = IO_URING;
+    io_watch(sv[0]);
+    if (write(sv[1], "x", 1) != 1) {
+        perror("write");
+    }
+    io_wait(1000);
+
+    works = iobuf_pending(&fd_state(sv[0])->in) == 1 && fd_state(sv[0])->recv_req != NULL;
+
+    io_unwatch(sv[0]);
+    Close(sv[0]);
+    Close(sv[1]);
+
+    // reap the cancelled recv, and leave no trace of the socketpair behind
+    for (int i = 0; i < 10 && uring_inflight > 0; i++) {
+        uring_wait(100);
+    }
+    memset(fd_state(sv[0]), 0, sizeof(struct fdstate));
+    memset(fd_state(sv[1]), 0, sizeof(struct fdstate));
+    ready_fds.len = 0;
+
+    if (!works) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    // undo everything set up so far, in reverse order
+    backend = IO_EPOLL;
+    free(ring.bufs);
+    ring.bufs = NULL;
+    if (ring.buf_ring != MAP_FAILED) {
+        munmap(ring.buf_ring, URING_NBUFS * sizeof(struct io_uring_buf));
+    }
+    if (ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (sq != MAP_FAILED) {
+        munmap(sq, ring_size);
+    }
+    Close(ring.fd);
+
+    return -1;
+}
+#endif
+
+/*
+ * sets up the I/O backend: io_uring if asked for and usable, epoll otherwise
+ */
+void io_init() {
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        if (uring_init() == 0) {
+            printf("Using io_uring\n");
+            return;
+        }
+        printf("io_uring is not available, falling back to epoll\n");
+    }
+#else
+    if (use_uring) {
+        printf("io_uring is not supported by this build, falling back to epoll\n");
+    }
+#endif
+
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+}
+
+/*
+ * Error-checking wrapper function for accept
+ *
+ * returns the new file descriptor returned by accept
+ * to read/write on, or -1 (with errno set) if none was accepted
+ */
+int Accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    int return_value;
+    int saved_errno;
+
+#ifdef HAVE_IO_URING
+    // connections were already accepted by the multishot accept
+    if (backend == IO_URING) {
+        if (accepted_fds.len == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        return_value = accepted_fds.fds[0];
+        memmove(accepted_fds.fds, accepted_fds.fds + 1, --accepted_fds.len * sizeof(int));
+
+        if (return_value < 0) {
+            errno = -return_value;
+            perror("accept");
+            errno = -return_value;
+            return -1;
+        }
+
+        return return_value;
+    }
+#endif
+
+    if ((return_value = accept(sockfd, addr, addrlen)) < 0) {
+        saved_errno = errno;
+
+        // running out of pending connections is expected, since sockfd is non-blocking
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
+
+        errno = saved_errno;
+        return return_value;
+    }
+
+    // connections are non-blocking too, so a read never stalls the server
+    fcntl(return_value, F_SETFL, fcntl(return_value, F_GETFL) | O_NONBLOCK);
+
+    return return_value;
+}
+
+/*
+ * Error-checking wrapper function for close
+ *
+ * output still queued for fd is sent if the socket takes it right away;
+ * errors are only reported; the fd is released either way
+ */
+void Close(int fd) {
+    struct fdstate *st = fd_state(fd);
+    struct io_req *req = NULL;
+
+#ifdef HAVE_IO_URING
+    // with a send in flight, the output still queued must go after it, so
+    // the request takes it over and closes fd once everything is sent
+    if (backend == IO_URING && st->send_req != NULL) {
+        req = st->send_req;
+        if (!st->failed) {
+            req->tail = st->out;
+            memset(&st->out, 0, sizeof(struct iobuf));
+        }
+        req->closing = 1;
+        uring_closing++;
+        st->send_req = NULL;
+    }
+#endif
+
+    if (req == NULL && iobuf_pending(&st->out) > 0 && !st->failed) {
+        send(fd, st->out.data + st->out.off, iobuf_pending(&st->out), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    io_unwatch(fd);
+    iobuf_free(&st->out);
+    st->failed = 0;
+    st->listener = 0;
+
+    // (the request closes fd, so the fd number is not reused before then)
+    if (req != NULL) {
+        return;
+    }
+
+    if (close(fd) == -1) {
+        perror("close");
+    }
+}
+
+/*
+ * Error-checking wrapper function for read
+ *
+ * returns the amount of bytes read, or -1 if the read failed
+ * (callers treat both 0 and -1 as a disconnection, unless no_input() says
+ * there was simply nothing to be read)
+ */
+ssize_t Read(int fd, void *buf, size_t count) {
+    struct fdstate *st = fd_state(fd);
+    ssize_t return_value;
+
+    // bytes received by io_uring (or handed over by the previous process on
+    // a hot upgrade) are read from the fd's input buffer first
+    if (iobuf_pending(&st->in) > 0) {
+        return_value = iobuf_pending(&st->in) < count ? iobuf_pending(&st->in) : count;
+        memcpy(buf, st->in.data + st->in.off, return_value);
+        iobuf_consume(&st->in, return_value);
+
+#ifdef HAVE_IO_URING
+        if (st->recv_paused) {
+            uring_rearm_recv(fd);
+        }
+#endif
+        return return_value;
+    }
+
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING) {
+        if (!st->eof) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (st->recv_errno != 0) {
+            errno = st->recv_errno;
+            perror("read");
+            return -1;
+        }
+
+        return 0;
+    }
+#endif
+
+    if ((return_value = read(fd, buf, count)) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("read");
+    }
+
+    return return_value;
+}
+
+/*
+ * returns 1 if a Read() that returned read_return found no input to be read
+ * (connections are non-blocking), and the connection is still there
+ */
+int no_input(ssize_t read_return) {
+    return read_return == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Error-checking wrapper function for write
+ *
+ * queues the bytes to be sent by the next io_flush()
+ *
+ * returns count, or -1 if sending to fd already failed or too much output
+ * is queued for it (the connection is then torn down by the caller)
+ */
+int Write(int fd, const void *buf, size_t count) {
+    struct fdstate *st = fd_state(fd);
+
+    if (st->failed) {
+        return -1;
+    }
+
+    if (iobuf_pending(&st->out) + count > OUTBUF_MAX) {
+        fprintf(stderr, "write: too much output queued for fd %d\n", fd);
+        st->failed = 1;
+        return -1;
+    }
+
+    iobuf_append(&st->out, buf, count);
+    mark_dirty(fd);
+
+    return count;
+}
+
+/*
+ * returns the last player in the list pointed by **list
+ *
+ * if the list is empty/NULL, returns NULL
+ */
+struct player *get_newest_player(struct player **list) {
+    struct player *newest_player = *list;
+    
+    if (newest_player != NULL) {
+        while (newest_player->next != NULL) {
+            newest_player = newest_player->next;
+        }
+    }
+
+    return newest_player;
+}
+
+/*
+ * returns the current time in milliseconds (monotonic clock)
+ */
+long long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * links timer into the wheel slot matching its expiry tick.
+ *
+ * timers due within WHEEL_SLOTS ticks go into level 0, the rest into the
+ * coarsest level they fit in; they are cascaded down as the wheel turns
+ */
+void wheel_insert(struct timer *timer) {
+    long long delta = timer->expires - wheel_tick;
+    int level = 0;
+    int slot;
+
+    if (delta < 0) {
+        timer->expires = wheel_tick;
+        delta = 0;
+    } else if (delta >= (1LL << (WHEEL_BITS * WHEEL_LEVELS))) {
+        delta = (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        timer->expires = wheel_tick + delta;
+    }
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1LL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    slot = (timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+    timer->next = wheel[level][slot];
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = &wheel[level][slot];
+    wheel[level][slot] = timer;
+}
+
+/*
+ * unlinks timer from its wheel slot
+ */
+void wheel_unlink(struct timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/*
+ * prepares timer to call callback (with data) once it expires
+ */
+void timer_init(struct timer *timer, void (*callback)(struct timer *), void *data) {
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/*
+ * disarms timer, if it is armed
+ */
+void timer_cancel(struct timer *timer) {
+    if (timer->pprev != NULL) {
+        wheel_unlink(timer);
+        wheel_count--;
+    }
+}
+
+/*
+ * (re-)arms timer to expire in ms milliseconds
+ */
+void timer_arm(struct timer *timer, long long ms) {
+    timer_cancel(timer);
+
+    timer->expires = (now_ms() + ms + TIMER_TICK - 1) / TIMER_TICK;
+    wheel_insert(timer);
+    wheel_count++;
+}
+
+/*
+ * turns the wheel up to the current time, firing every expired timer
+ * (callbacks may cancel or arm any timer)
+ */
+void timers_advance() {
+    long long target = now_ms() / TIMER_TICK;
+    struct timer *timer;
+    int level, slot;
+
+    // nothing to fire, so there is no need to turn the wheel tick by tick
+    if (wheel_count == 0) {
+        if (target >= wheel_tick) {
+            wheel_tick = target + 1;
+        }
+        return;
+    }
+
+    while (wheel_tick <= target) {
+        // on the first tick of a level's slot, its timers are cascaded into the
+        // lower levels (coarsest level first, so they can cascade all the way down)
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel_tick & ((1LL << (WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+        }
+
+        for (level--; level >= 1; level--) {
+            slot = (wheel_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+            while ((timer = wheel[level][slot]) != NULL) {
+                wheel_unlink(timer);
+                wheel_insert(timer);
+            }
+        }
+
+        slot = wheel_tick & (WHEEL_SLOTS - 1);
+
+        while ((timer = wheel[0][slot]) != NULL) {
+            wheel_unlink(timer);
+            wheel_count--;
+            timer->callback(timer);
+        }
+
+        wheel_tick++;
+    }
+}
+
+/*
+ * returns the number of milliseconds until the wheel next needs to be turned
+ * (a timer fires or a level needs cascading), or -1 if no timer is armed
+ */
+long long timers_next_timeout() {
+    long long wait;
+    int i;
+
+    if (wheel_count == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        if (((wheel_tick + i) & (WHEEL_SLOTS - 1)) == 0 ||
+                wheel[0][(wheel_tick + i) & (WHEEL_SLOTS - 1)] != NULL) {
+            break;
+        }
+    }
+
+    wait = (wheel_tick + i) * TIMER_TICK - now_ms();
+    if (wait < 0) {
+        wait = 0;
+    }
+
+    return wait;
+}
+
+/*
+ * returns the hash of the string str (FNV-1a)
+ */
+unsigned int name_hash(const char *str) {
+    unsigned int hash = 2166136261u;
+
+    for (; *str; str++) {
+        hash = (hash ^ (unsigned char) *str) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * returns the interned name equal to str, NULL if there is none
+ */
+struct name *name_lookup(const char *str) {
+    unsigned int hash = name_hash(str);
+
+    if (names == NULL) {
+        return NULL;
+    }
+
+    for (struct name *n = names[hash & (names_size - 1)]; n; n = n->next) {
+        if (n->hash == hash && strcmp(n->str, str) == 0) {
+            return n;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * doubles the number of buckets of names (creating it on first use)
+ */
+void names_grow() {
+    int new_size = names_size ? names_size * 2 : NAME_BUCKETS;
+    struct name **new_names = Malloc(new_size * sizeof(struct name *));
+
+    memset(new_names, 0, new_size * sizeof(struct name *));
+
+    for (int i = 0; i < names_size; i++) {
+        while (names[i] != NULL) {
+            struct name *n = names[i];
+
+            names[i] = n->next;
+            n->next = new_names[n->hash & (new_size - 1)];
+            new_names[n->hash & (new_size - 1)] = n;
+        }
+    }
+
+    free(names);
+    names = new_names;
+    names_size = new_size;
+}
+
+/*
+ * returns the interned copy of str, taking a reference to it
+ * (dropped with name_release)
+ */
+char *name_intern(const char *str) {
+    struct name *n = name_lookup(str);
+    int len;
+
+    if (n == NULL) {
+        if (names_count >= names_size) {
+            names_grow();
+        }
+
+        len = strlen(str);
+        n = Malloc(sizeof(struct name) + len + 1);
+        n->refs = 0;
+        n->hash = name_hash(str);
+        memcpy(n->str, str, len + 1);
+        n->next = names[n->hash & (names_size - 1)];
+        names[n->hash & (names_size - 1)] = n;
+        names_count++;
+    }
+
+    n->refs++;
+
+    return n->str;
+}
+
+/*
+ * drops a reference to the interned name str, freeing it with the last one
+ *
+ * "" (the name of unnamed players) is not interned and is ignored
+ */
+void name_release(char *str) {
+    struct name *n;
+    struct name **link;
+
+    if (*str == '\0') {
+        return;
+    }
+
+    n = (struct name *) (str - offsetof(struct name, str));
+    if (--n->refs > 0) {
+        return;
+    }
+
+    for (link = &names[n->hash & (names_size - 1)]; *link != n; link = &((*link)->next)) {
+    }
+    *link = n->next;
+    names_count--;
+
+    free(n);
+}
+
+/*
+ * checks to see if the input name already exists within the lobby or any room.
+ * If so, returns 0, otherwise 1;
+ *
+ * (only complete, valid names are interned, so it is enough to look it up)
+ */
+int name_valid(char *name) {
+    if (strlen(name) == 0) {
+        return 0;
+    }
+
+    if (name_lookup(name) != NULL) {
+        return 0;
+    }
+    
+    return 1;
+}
+
+/*
+ * refills bucket for the time passed since its last refill, at rate tokens
+ * per second up to burst tokens
+ */
+void bucket_refill(struct bucket *bucket, int rate, int burst, long long now) {
+    long long tokens = bucket->tokens + (now - bucket->stamp) * rate;
+
+    bucket->tokens = tokens > burst * 1000LL ? burst * 1000 : tokens;
+    bucket->stamp = now;
+}
+
+/*
+ * returns the bucket of sources for the IPv4 address addr (network order)
+ *
+ * (multiplicative hashing, keeping the top bits of the product, as the low
+ * ones only depend on the low bits of the address)
+ */
+struct source **source_bucket(in_addr_t addr) {
+    return &sources[(addr * 2654435761u) >> (32 - SOURCE_BITS)];
+}
+
+/*
+ * returns the source of the peer of fd, taking a reference to it
+ * (dropped with source_release), or NULL if fd has no IPv4 peer
+ */
+struct source *source_get(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct source **bucket;
+    struct source *src;
+
+    if (getpeername(fd, (struct sockaddr *) &addr, &len) == -1 || addr.sin_family != AF_INET) {
+        return NULL;
+    }
+
+    bucket = source_bucket(addr.sin_addr.s_addr);
+    for (src = *bucket; src; src = src->next) {
+        if (src->addr == addr.sin_addr.s_addr) {
+            src->refs++;
+            return src;
+        }
+    }
+
+    src = Malloc(sizeof(struct source));
+
+    src->addr = addr.sin_addr.s_addr;
+    src->refs = 1;
+    src->input.stamp = now_ms();
+    src->input.tokens = SOURCE_INPUT_BURST * 1000;
+    src->next = *bucket;
+    *bucket = src;
+
+    return src;
+}
+
+/*
+ * drops a reference to src (NULL is ignored), freeing it with the last one
+ */
+void source_release(struct source *src) {
+    struct source **link;
+
+    if (src == NULL || --src->refs > 0) {
+        return;
+    }
+
+    for (link = source_bucket(src->addr); *link != src; link = &((*link)->next)) {
+    }
+    *link = src->next;
+
+    free(src);
+}
+
+/*
+ * allocates an empty frame with room for size bytes (including the \0)
+ *
+ * returns the new frame, holding one reference for the caller
+ */
+struct frame *alloc_frame(size_t size) {
+    struct frame *frame = Malloc(sizeof(struct frame) + size);
+
+    frame->refs = 1;
+    frame->seq = 0;
+    frame->len = 0;
+    frame->data[0] = '\0';
+
+    return frame;
+}
+
+/*
+ * renders the state of all the game boards in the room into a single frame
+ *
+ * returns the new frame, holding one reference for the caller
+ */
+struct frame *render_boards(struct room *room) {
+    int nplayers = 0;
+    size_t size;
+    struct frame *frame;
+
+    for (struct player *p = room->playerlist; p; p = p->next) {
+        nplayers++;
+    }
+
+    // each board line is bounded by 2 * MAXMESSAGE (name plus 7 pits)
+    size = nplayers * 2 * MAXMESSAGE + 1;
+    frame = alloc_frame(size);
+
+    for (struct player *p = room->playerlist; p; p = p->next) {
+        frame->len += snprintf(frame->data + frame->len, size - frame->len, "%s: ", p->name);
+
+        for (int i = 0; i <= NPITS; i++) {
+            if (i < NPITS) {
+                frame->len += snprintf(frame->data + frame->len, size - frame->len,
+                        "[%d]%d ", i, p->pits[i]);
+            } else {
+                frame->len += snprintf(frame->data + frame->len, size - frame->len,
+                        "[end pit]%d\r\n", p->pits[i]);
+            }
+        }
+    }
+
+    return frame;
+}
+
+/*
+ * drops a reference to frame, freeing it once no one holds it
+ */
+void release_frame(struct frame *frame) {
+    if (frame != NULL && --frame->refs == 0) {
+        free(frame);
+    }
+}
+
+/*
+ * displays the state of all the game boards to all players in the room
+ *
+ * the same encoded frame is queued for the room's spectators; only the last frame
+ * queued during a loop iteration is published to them (see publish_frame)
+ */
+void show_boards(struct room *room) {
+    long long start = trace_begin();
+    struct frame *frame = render_boards(room);
+
+    PROBE2(render, room->id, frame->len);
+    trace_end("render", start, room->id, -1);
+
+    printf("Displaying boards to players in room %d\n", room->id);
+
+    broadcast(room, frame->data);
+
+    release_frame(room->pending_frame);
+    room->pending_frame = frame;
+}
+
+/*
+ * unlinks a player from list and replaces them with the next player.
+ * If the player was the last one, they are replaced by the first player in list
+ * (and by NULL if list is now empty)
+ * 
+ * Uses pointers to pointers to make sure old_player and list are kept updated
+ */
+void unlink_player(struct player **old_player, struct player **list) {
+    int old_fd = (*old_player)->fd;
+
+
+    // if old_player is the first player...
+    if ((*list)->fd == old_fd) {
+        *list = (*list)->next;
+        *old_player = (*list);
+    } else {
+        for (struct player **p = list; *p; p = &((*p)->next)) {
+            // once the player before old_player is found...
+            if ((*p)->next->fd == old_fd) { 
+                (*p)->next = (*p)->next->next;
+                
+                // if the player that disconnected was the last one in playerlist...
+                if ((*p)->next == NULL) {
+                    *old_player = *list;
+                } else {
+                    *old_player = (*p)->next;
+                }
+                
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * removes a player in list and replaces them with the next player (see unlink_player).
+ * If the player was seated in a room, the rest of the room is notified
+ */
+void remove_player(struct player **old_player, struct player **list) {
+    char msg[MAXMESSAGE + 1];
+    int old_fd = (*old_player)->fd;
+    char *old_name = (*old_player)->name;
+    struct room *room = (*old_player)->room;
+    struct player *free_value = *old_player;
+
+    timer_cancel(&free_value->timer);
+    
+    // don't close here if list == &templist since read_name has already
+    // closed the fd by then
+    if (list != &templist) {
+        Close(old_fd);
+
+        memset(msg, '\0', MAXMESSAGE + 1);
+    }
+
+    unlink_player(old_player, list);
+    
+    // when a player outside of a room disconnects, no one needs to be notified
+    if (room != NULL) {
+        printf("%s has left room %d.\n", old_name, room->id);
+    
+        if (room->playerlist != NULL) {
+            sprintf(msg, "%s has left the game.\r\n", old_name);
+        
+            broadcast(room, msg);
+            show_boards(room);
+        } else {
+            printf("All players have left room %d.\n", room->id);
+        }
+    }
+
+    // free at the end so that player names can still be printed
+    name_release(free_value->name);
+    source_release(free_value->source);
+    if (free_value->partial_name != NULL) {
+        block_put(free_value->partial_name);
+    }
+    free(free_value);    
+}
+
+/*
+ * moves a player from the list from to the end of the list to
+ */
+void move_player(struct player *player, struct player **from, struct player **to) {
+    struct player *unlinked = player;
+    struct player *last_player;
+
+    unlink_player(&unlinked, from);
+
+    last_player = get_newest_player(to);
+    player->next = NULL;
+
+    if (last_player == NULL) {
+        *to = player;
+    } else {
+        last_player->next = player;
+    }
+}
+
+/*
+ * adds a dynamic memory-allocated struct player to the end of list
+ *
+ * the player is not seated in any room (see seat_player)
+ */
+void add_new_player(int fd, struct player **list) {
+    struct player *new_player = Malloc(sizeof(struct player));
+    struct player *last_player = get_newest_player(list);
+    
+    new_player->fd = fd;
+    new_player->name = "";
+    new_player->partial_name = NULL;
+    memset(new_player->pits, 0, sizeof(new_player->pits));
+    new_player->points = 0;
+    new_player->named = 0;
+    new_player->size = 0;
+    new_player->rating = INITIAL_RATING;
+    new_player->queued_at = 0;
+    new_player->noticed_at = 0;
+    new_player->input.stamp = now_ms();
+    new_player->input.tokens = INPUT_BURST * 1000;
+    new_player->source = source_get(fd);
+    new_player->skipped_turns = 0;
+    new_player->dead = 0;
+    new_player->room = NULL;
+    new_player->next = NULL;
+    timer_init(&new_player->timer, name_timeout, new_player);
+    
+    // if this is the first player for list...
+    if (last_player == NULL) {
+        *list = new_player;
+    } else {
+        last_player->next = new_player;
+    }
+}
+
+/*
+ * moves a queued player to the end of the room's playerlist
+ * and gives them a fresh board
+ */
+void seat_player(struct player *player, struct room *room) {
+    int num_pebbles = compute_average_pebbles(room);
+
+    for (int i = 0; i < NPITS; i++) {
+        player->pits[i] = num_pebbles;
+    }
+    player->pits[NPITS] = 0;
+    player->points = 0;
+    player->skipped_turns = 0;
+
+    // the turn timer is only armed while it is the player's turn
+    timer_cancel(&player->timer);
+    timer_init(&player->timer, turn_timeout, player);
+
+    move_player(player, &queuelist, &room->playerlist);
+    player->room = room;
+}
+
+/*
+ * removes newline characters and null-terminates the string
+ *
+ * does so regardless of the format of the newline
+ *
+ * returns 1 if the string was properly null-terminated,
+ * returns 0 otherwise (input was incomplete)
+ */
+int null_terminate(char *string, int size) {
+    for (int i = 0; i < size; i++) {
+        if (string[i] == '\r' || string[i] == '\n') {
+            string[i] = '\0';
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * reads input from a player and null terminates it 
+ */
+int read_input(int player_fd, char *input, int max_input) {
+    int read_return;
+
+    memset(input, '\0', max_input + 1);
+    read_return = Read(player_fd, input, max_input);
+
+    null_terminate(input, max_input);
+
+    return read_return;
+}
+
+/*
+ * reads (more of) a player's name into their partial_name, and interns it
+ * as their name once it is complete and valid
+ * 
+ * returns 1 if a complete name was received, 0 if not, -1 if the player
+ * disconnected (before completing name), and -2 if there was no input after all
+ */
+int read_name(struct player *player) {
+    char *msg = "That name is already invalid. Must not be blank and must not match any other\r\n";
+    ssize_t read_return;
+    int len;
+    int return_value = 0;
+
+    // the name is only given a buffer while it is being received
+    if (player->partial_name == NULL) {
+        player->partial_name = block_get();
+        player->partial_name[0] = '\0';
+    }
+
+    // read right behind what was received so far (the block has room for
+    // two names, so a name cut off at MAXNAME can still be completed)
+    len = strlen(player->partial_name);
+    memset(player->partial_name + len, '\0', MAXNAME + 1);
+
+    // if the player disconnects...
+    if ((read_return = Read(player->fd, player->partial_name + len, MAXNAME)) <= 0) {
+        if (no_input(read_return)) {
+            return -2;
+        }
+
+        Close(player->fd);
+        
+        return -1;
+    }
+
+    return_value = null_terminate(player->partial_name + len, MAXNAME);
+    player->partial_name[MAXNAME] = '\0';
+
+    // if the name is complete and the name is invalid
+    if (return_value == 1 && !name_valid(player->partial_name)) {
+        printf("Player input an invalid name: %s. Prompting for a new name\n", player->partial_name);
+        player->partial_name[0] = '\0';
+
+        // treat a failed write like a disconnection
+        if (Write(player->fd, msg, strlen(msg)) == -1) {
+            Close(player->fd);
+
+            return -1;
+        }
+
+        return_value = 0;
+    }
+
+    if (return_value == 1) {
+        player->name = name_intern(player->partial_name);
+        block_put(player->partial_name);
+        player->partial_name = NULL;
+    }
+
+    return return_value;
+}
+
+/*
+ * returns the player's seat (position in turn order) in their room, -1 if not seated
+ */
+int player_seat(struct player *player) {
+    int seat = 0;
+
+    if (player->room == NULL) {
+        return -1;
+    }
+
+    for (struct player *p = player->room->playerlist; p && p != player; p = p->next) {
+        seat++;
+    }
+
+    return seat;
+}
+
+/*
+ * Writes a message to the indicated player.
+ * 
+ * If the player has disconnected, the player is marked dead and later removed
+ * by reap_dead_players() (the caller may still be using the player)
+ */
+void notify_player(struct player **player, char *msg, int size) {
+    char buffer[size + 1];
+
+    if ((*player)->dead) {
+        return;
+    }
+
+    memset(buffer, '\0', size + 1);
+    strncpy(buffer, msg, size);
+
+    if (Write((*player)->fd, buffer, strlen(msg)) != strlen(msg)) {
+        (*player)->dead = 1;
+    }
+
+    PROBE4(message, (*player)->room != NULL ? (*player)->room->id : 0,
+            player_seat(*player), (*player)->fd, strlen(msg));
+}
+
+/*
+ * notifies all players except the indicated player
+ * 
+ * uses a pointer to a pointer to accommodate other functions
+ */
+void notify_all_other_players(struct player **excluded_player, char *msg, int size) {
+    for (struct player *p = (*excluded_player)->room->playerlist; p; p = p->next) {
+        if (p->fd != (*excluded_player)->fd) {
+            notify_player(&p, msg, size);
+        }
+    }
+}
+
+/*
+ * counts dropped input (or a suppressed reply), logging the counts
+ * once INPUT_STATS_INTERVAL has passed (see log_dropped_input)
+ */
+void count_dropped_input(long long reads, long long bytes, long long notices) {
+    dropped_reads += reads;
+    dropped_bytes += bytes;
+    suppressed_notices += notices;
+
+    if (stats_timer.pprev == NULL) {
+        timer_arm(&stats_timer, INPUT_STATS_INTERVAL);
+    }
+}
+
+/*
+ * called INPUT_STATS_INTERVAL after input was first dropped; logs (and resets)
+ * the counts of dropped input
+ */
+void log_dropped_input(struct timer *timer) {
+    printf("Rate limits dropped %lld reads (%lld bytes) of input and %lld replies in the last %ds\n",
+            dropped_reads, dropped_bytes, suppressed_notices, INPUT_STATS_INTERVAL / 1000);
+
+    dropped_reads = 0;
+    dropped_bytes = 0;
+    suppressed_notices = 0;
+}
+
+/*
+ * replies msg to a player's unexpected input (a move out of turn, an invalid move
+ * and the like), unless they were already replied to within NOTICE_INTERVAL
+ *
+ * returns 1 if msg was sent, 0 if it was suppressed
+ */
+int notify_player_coalesced(struct player **player, char *msg) {
+    long long now = now_ms();
+
+    if ((*player)->noticed_at != 0 && now - (*player)->noticed_at < NOTICE_INTERVAL) {
+        count_dropped_input(0, 0, 1);
+        return 0;
+    }
+
+    (*player)->noticed_at = now;
+    notify_player(player, msg, MAXMESSAGE);
+
+    return 1;
+}
+
+/*
+ * returns 1 if the player has input to be handled this loop iteration.
+ *
+ * input beyond the player's rate limit (INPUT_RATE), or that of everyone from
+ * their IP address (SOURCE_INPUT_RATE), is read and dropped before it is
+ * parsed, so a flooding client can not make the server do work on their behalf.
+ * Disconnections are always handled
+ */
+int player_ready(struct player *player) {
+    char discard[INPUT_DISCARD];
+    struct source *src = player->source;
+    long long now;
+    ssize_t read_return;
+
+    if (!io_ready(player->fd)) {
+        return 0;
+    }
+
+    now = now_ms();
+    bucket_refill(&player->input, INPUT_RATE, INPUT_BURST, now);
+    if (src != NULL) {
+        bucket_refill(&src->input, SOURCE_INPUT_RATE, SOURCE_INPUT_BURST, now);
+    }
+
+    if (player->input.tokens >= 1000 && (src == NULL || src->input.tokens >= 1000)) {
+        player->input.tokens -= 1000;
+        if (src != NULL) {
+            src->input.tokens -= 1000;
+        }
+        return 1;
+    }
+
+    // once read, EOF and errors are reported again by the handler's own read
+    if ((read_return = Read(player->fd, discard, INPUT_DISCARD)) <= 0) {
+        return !no_input(read_return);
+    }
+
+    PROBE2(drop, player->fd, read_return);
+    count_dropped_input(1, read_return, 0);
+
+    // the rest of a name can not be pieced onto what came before the dropped bytes
+    if (player->partial_name != NULL) {
+        player->partial_name[0] = '\0';
+    }
+
+    return 0;
+}
+
+/*
+ * updates the counts of points of all players in the room
+ */
+void update_points(struct room *room) {
+    for (struct player *p = room->playerlist; p; p = p->next) {
+        p->points = mancala_score(p->pits);
+    }
+}
+
+/*
+ * points boards at the pits of the room's players, in turn order
+ *
+ * returns the number of players
+ */
+int room_boards(struct room *room, int *boards[]) {
+    int nplayers = 0;
+
+    for (struct player *p = room->playerlist; p && nplayers < MAXROOMSIZE; p = p->next) {
+        boards[nplayers++] = p->pits;
+    }
+
+    return nplayers;
+}
+
+/*
+ * makes the necessary adjustments to game boards/struct players
+ * based on the input move and returns 1 if the player
+ * has earned an extra move, 0 if not and -1 if the move was invalid.
+ * 
+ * if the input move is invalid, the player is notified of
+ * such and prompted to try again
+ */
+int make_move(struct player **cur_player, char *input) {
+    long long start = trace_begin();
+    int move = strtol(input, NULL, 10);
+    int *boards[MAXROOMSIZE];
+    int nplayers = room_boards((*cur_player)->room, boards);
+    int seat = player_seat(*cur_player);
+    int extra_m;
+ 
+    extra_m = mancala_sow(boards, nplayers, seat, move);
+
+    PROBE4(move, (*cur_player)->room->id, seat, move, extra_m);
+    trace_end("move", start, (*cur_player)->room->id, seat);
+
+    if (extra_m == -1 && notify_player_coalesced(cur_player,
+                "That move is invalid. Please input the index to a non-end pit (pit must have 1+ pebbles)\r\n")) {
+        printf("Player input an invalid move: %d. Prompting for new move\n", move);
+    }
+
+    return extra_m;
+}
+
+/*
+ * removes a spectator from their list and replaces them with the next spectator
+ *
+ * the spectator's connection is closed and their frame reference dropped
+ */
+void remove_spectator(struct spectator **spectator) {
+    struct spectator *free_value = *spectator;
+
+    printf("A spectator has stopped watching\n");
+
+    Close(free_value->fd);
+    release_frame(free_value->frame);
+
+    *spectator = free_value->next;
+    free(free_value);
+}
+
+/*
+ * starts sending the latest frame of the watched room to an idle spectator,
+ * unless they have already started it
+ */
+void catch_up_spectator(struct spectator *spectator) {
+    struct frame *latest;
+
+    if (spectator->frame != NULL || spectator->room == NULL) {
+        return;
+    }
+
+    latest = spectator->room->latest_frame;
+
+    if (latest != NULL && latest->seq > spectator->sent_seq) {
+        spectator->frame = latest;
+        spectator->frame->refs++;
+        spectator->sent = 0;
+        spectator->sent_seq = latest->seq;
+    }
+}
+
+/*
+ * writes as much of the spectator's current frame as the socket accepts,
+ * moving on to the room's latest frame (skipping any frames in between) once it is done
+ *
+ * returns 0 on success, -1 if the spectator's connection failed
+ */
+int flush_spectator(struct spectator *spectator) {
+    ssize_t written;
+
+    while (spectator->frame != NULL) {
+        if (spectator->sent < spectator->frame->len) {
+            written = send(spectator->fd, spectator->frame->data + spectator->sent,
+                    spectator->frame->len - spectator->sent, MSG_NOSIGNAL);
+
+            if (written == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                return -1;
+            }
+
+            spectator->sent += written;
+            continue;
+        }
+
+        // the frame is done, catch up to the latest frame (if it is newer)
+        release_frame(spectator->frame);
+        spectator->frame = NULL;
+        spectator->lag = 0;
+
+        catch_up_spectator(spectator);
+    }
+
+    return 0;
+}
+
+/*
+ * publishes the room's pending_frame to all of its spectators.
+ *
+ * idle spectators start sending it immediately, while spectators still sending
+ * an older frame will skip straight to it once they are done. Spectators that
+ * fall more than SPECTATOR_MAX_LAG frames behind are dropped
+ */
+void publish_frame(struct room *room) {
+    struct spectator **s = &room->spectatorlist;
+
+    if (room->pending_frame == NULL) {
+        return;
+    }
+
+    release_frame(room->latest_frame);
+    room->latest_frame = room->pending_frame;
+    room->latest_frame->seq = ++frame_seq;
+    room->pending_frame = NULL;
+
+    while (*s) {
+        if ((*s)->frame == NULL) {
+            catch_up_spectator(*s);
+        } else if (++(*s)->lag > SPECTATOR_MAX_LAG) {
+            printf("A spectator of room %d fell too far behind. Dropping them\n", room->id);
+            remove_spectator(s);
+            continue;
+        }
+
+        if (flush_spectator(*s) == -1) {
+            remove_spectator(s);
+            continue;
+        }
+
+        s = &((*s)->next);
+    }
+}
+
+/*
+ * moves a spectator from their list to the front of the room's spectatorlist
+ *
+ * the spectator is replaced by the next spectator in their old list
+ */
+void attach_spectator(struct spectator **spectator, struct room *room) {
+    struct spectator *moved = *spectator;
+
+    *spectator = moved->next;
+
+    moved->room = room;
+    moved->next = room->spectatorlist;
+    room->spectatorlist = moved;
+
+    catch_up_spectator(moved);
+}
+
+/*
+ * turns a connection that entered WATCH_COMMAND into a spectator of
+ * the room with id room_id (any room if room_id == 0)
+ *
+ * if there is no such room, the spectator waits in spectatorlist for the next room
+ */
+void add_new_spectator(int fd, int room_id) {
+    struct spectator *new_spectator = Malloc(sizeof(struct spectator));
+    struct room *room = NULL;
+    char msg[MAXMESSAGE + 1];
+
+    new_spectator->fd = fd;
+    new_spectator->frame = NULL;
+    new_spectator->sent = 0;
+    new_spectator->sent_seq = 0;
+    new_spectator->lag = 0;
+    new_spectator->watch_room = room_id;
+    new_spectator->room = NULL;
+    new_spectator->next = spectatorlist;
+    spectatorlist = new_spectator;
+
+    for (struct room *r = roomlist; r; r = r->next) {
+        if (room_id == 0 || r->id == room_id) {
+            room = r;
+            break;
+        }
+    }
+
+    memset(msg, '\0', MAXMESSAGE + 1);
+    if (room != NULL) {
+        sprintf(msg, "You are now spectating room %d\r\n", room->id);
+    } else {
+        sprintf(msg, "No room to watch yet. Waiting for a game to start...\r\n");
+    }
+
+    // best effort, the socket buffer of a new connection is empty
+    send(fd, msg, strlen(msg), MSG_NOSIGNAL);
+
+    if (room != NULL) {
+        attach_spectator(&spectatorlist, room);
+    }
+}
+
+/*
+ * handles reads (discarded, spectators are read-only) and pending writes
+ * for all spectators in list
+ */
+void handle_spectators(struct spectator **list) {
+    char input[MAXMESSAGE + 1];
+    struct spectator **s = list;
+    ssize_t read_return;
+
+    while (*s) {
+        if (io_ready((*s)->fd)) {
+            read_return = Read((*s)->fd, input, MAXMESSAGE);
+
+            if (read_return <= 0 && !no_input(read_return)) {
+                remove_spectator(s);
+                continue;
+            }
+        }
+
+        if (io_writable((*s)->fd) && flush_spectator(*s) == -1) {
+            remove_spectator(s);
+            continue;
+        }
+
+        s = &((*s)->next);
+    }
+}
+
+/*
+ * waits for writability of exactly the spectators in list with a frame still in progress
+ */
+void set_pending_spectators(struct spectator *list) {
+    for (struct spectator *s = list; s; s = s->next) {
+        io_want_write(s->fd, s->frame != NULL);
+    }
+}
+
+/*
+ * updates the ratings of all players in the room (Elo, treating every
+ * pair of players as a separate match decided by their points)
+ */
+void update_ratings(struct room *room) {
+    int nplayers = 0;
+    int i = 0, j;
+
+    for (struct player *p = room->playerlist; p; p = p->next) {
+        nplayers++;
+    }
+
+    // deltas are computed before any rating changes so the order of players doesn't matter
+    double delta[nplayers];
+    memset(delta, 0, sizeof(delta));
+
+    for (struct player *p = room->playerlist; p; p = p->next, i++) {
+        j = 0;
+        for (struct player *q = room->playerlist; q; q = q->next, j++) {
+            if (p == q) {
+                continue;
+            }
+
+            double expected = 1.0 / (1.0 + pow(10.0, (q->rating - p->rating) / 400.0));
+            double score = p->points > q->points ? 1.0 : (p->points == q->points ? 0.5 : 0.0);
+
+            delta[i] += (double) RATING_K / (nplayers - 1) * (score - expected);
+        }
+    }
+
+    i = 0;
+    for (struct player *p = room->playerlist; p; p = p->next, i++) {
+        p->rating += lround(delta[i]);
+    }
+}
+
+/*
+ * stops watching listenfd for accept_backoff milliseconds (doubling it for next time)
+ */
+void backoff_accept() {
+    printf("Pausing new connections for %dms\n", accept_backoff);
+
+    io_unwatch(listenfd);
+
+    timer_arm(&accept_timer, accept_backoff);
+
+    accept_backoff *= 2;
+    if (accept_backoff > ACCEPT_BACKOFF_MAX) {
+        accept_backoff = ACCEPT_BACKOFF_MAX;
+    }
+}
+
+/*
+ * called once an accept backoff is over; watches listenfd again
+ */
+void resume_accept(struct timer *timer) {
+    io_watch(listenfd);
+}
+
+/*
+ * turns away a pending connection with msg, for when it can not be served
+ */
+void refuse_connection(int fd, char *msg) {
+    send(fd, msg, strlen(msg), MSG_NOSIGNAL);
+    Close(fd);
+}
+
+/*
+ * handles a failed Accept() based on errno
+ *
+ * returns 1 if accepting should stop for this loop iteration, 0 otherwise
+ */
+int handle_accept_error() {
+    int refused_fd;
+
+    switch (errno) {
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+        // the connection was lost before it could be accepted, try the next one
+        return 0;
+    case EMFILE:
+    case ENFILE:
+        // out of fds: give up the reserved fd so the pending connection can be
+        // accepted and turned away, instead of it keeping listenfd readable forever
+        if (reserve_fd != -1) {
+            Close(reserve_fd);
+        }
+
+        if ((refused_fd = accept(listenfd, NULL, NULL)) != -1) {
+            refuse_connection(refused_fd, "The server is full. Please try again later\r\n");
+        }
+
+        reserve_fd = open("/dev/null", O_RDONLY);
+        backoff_accept();
+        return 1;
+    case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+    case EWOULDBLOCK:
+#endif
+        return 1;
+    default:
+        // ENOBUFS, ENOMEM and the like, give the system some time to recover
+        backoff_accept();
+        return 1;
+    }
+}
+
+/*
+ * handles the scenario when new players connect (up to ACCEPT_BATCH per call).
+ * 
+ * prompts each player for a name and adds them to the end of templist
+ *
+ * this player is not added to queuelist until a complete name and room size is received
+ */
+void handle_player_creation() {
+    int new_player_fd;
+    struct player *new_player;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        if ((new_player_fd = Accept(listenfd, NULL, NULL)) == -1) {
+            if (handle_accept_error()) {
+                return;
+            }
+            continue;
+        }
+
+        accept_backoff = ACCEPT_BACKOFF_MIN;
+
+        printf("New player connected. Prompting for name\n");
+
+        add_new_player(new_player_fd, &templist);
+        new_player = get_newest_player(&templist);
+
+        notify_player(&new_player, "Welcome to Mancala. What is your name? (enter " WATCH_COMMAND " [room] to spectate)\r\n", MAXMESSAGE);
+        timer_arm(&new_player->timer, NAME_TIMEOUT);
+
+        io_watch(new_player_fd);
+    }
+}
+
+/*
+ * handles the case when the current player does some interaction
+ * (enters a move or disconnects)
+ * 
+ * returns 0 if the current player is still connected, returns 1 otherwise and
+ * returns -1 if extra_m == -1 (indicating an invalid input move)
+ */
+int handle_current_player(struct player **cur_player, int *prompted, int *next_p, int *extra_m) {
+    int player_fd = (*cur_player)->fd;
+    struct room *room = (*cur_player)->room;
+    char input[MAXMESSAGE + 1];
+    int read_return;
+    char msg[MAXMESSAGE + 1];
+    
+    read_return = read_input(player_fd, input, MAXMESSAGE);
+
+    // nothing was there to be read after all
+    if (no_input(read_return)) {
+        return 0;
+    }
+
+    // check to see if the player disconnected
+    if (read_return <= 0) {
+        remove_player(cur_player, &room->playerlist);
+        
+        // set to indicate that the (new) current player was not prompted,
+        // the current player does not need to be switched and the
+        // the current player did not earn a new move
+        *prompted = 0;
+        *next_p = 0;
+        *extra_m = 0;
+                      
+        return 1;
+    } else if (room->playerlist->next == NULL) {
+        // if cur_player is the only player...
+        notify_player(cur_player, "Waiting for more players...\r\n", MAXMESSAGE);
+        return 0;
+    } else if (*next_p) {
+        // their turn was skipped (see turn_timeout) before the move was handled
+        if (notify_player_coalesced(cur_player, "Your turn was skipped. Please wait your turn\r\n")) {
+            printf("%s moved after their turn was skipped. Advising them to wait their turn\n", (*cur_player)->name);
+        }
+        return 0;
+    }
+    
+    // if the input move is invalid...
+    if ((*extra_m = make_move(cur_player, input)) == -1) {
+        return -1;
+    }
+
+    // indicate it is the next player's turn
+    *next_p = 1;
+
+    timer_cancel(&(*cur_player)->timer);
+    (*cur_player)->skipped_turns = 0;
+
+    printf("%s made a move: %s\n", (*cur_player)->name, input); 
+    memset(msg, '\0', MAXMESSAGE + 1);
+    sprintf(msg, "%s made a move: %s\r\n", (*cur_player)->name, input);
+    notify_all_other_players(cur_player, msg, MAXMESSAGE);
+                         
+    return 0;
+}
+
+/*
+ * handles the case when a player other than the current player does some interaction
+ * 
+ * returns 1 if opter_p == NULL; returns 0 otherwise
+ */
+int handle_other_players(struct player **other_p, int *prompted) {
+    int player_fd = (*other_p)->fd;
+    char input[MAXMESSAGE + 1];
+    int read_return;
+    
+    read_return = read_input(player_fd, input, MAXMESSAGE);
+
+    // nothing was there to be read after all
+    if (no_input(read_return)) {
+        return 0;
+    }
+
+    // check to see if the player disconnected
+    if (read_return <= 0) {
+        remove_player(other_p, &(*other_p)->room->playerlist);
+        
+        *prompted = 0;
+                    
+        if (*other_p == NULL) {
+            return 1;
+        }
+        return 0;
+    }
+
+    // a player sending move after move out of turn is only told once in a while
+    if (notify_player_coalesced(other_p, "Please wait your turn\r\n")) {
+        printf("%s played out of turn. Advising them to wait their turn\n", (*other_p)->name);
+    }
+
+    return 0;
+}
+
+/*
+ * handles a named player in templist choosing the size of room they want to play in
+ *
+ * once a valid size is received, the player is moved to the end of queuelist
+ *
+ * returns 1 if the player left templist, 0 otherwise
+ */
+int handle_room_size(struct player **temp) {
+    int player_fd = (*temp)->fd;
+    char input[MAXMESSAGE + 1];
+    int read_return;
+    char msg[MAXMESSAGE + 1];
+    char *end;
+    long size;
+
+    read_return = read_input(player_fd, input, MAXMESSAGE);
+
+    // nothing was there to be read after all
+    if (no_input(read_return)) {
+        return 0;
+    }
+
+    // check to see if the player disconnected
+    if (read_return <= 0) {
+        printf("%s disconnected before choosing a room size\n", (*temp)->name);
+
+        Close(player_fd);
+        remove_player(temp, &templist);
+
+        return 1;
+    }
+
+    if (input[0] == '\0') {
+        size = DEFAULT_ROOM_SIZE;
+    } else {
+        size = strtol(input, &end, 10);
+
+        if (*end != '\0' || size < MINROOMSIZE || size > MAXROOMSIZE) {
+            printf("%s input an invalid room size: %s. Prompting for a new size\n", (*temp)->name, input);
+            notify_player(temp, "That room size is invalid. Please input a number from 2 to 6\r\n", MAXMESSAGE);
+
+            return 0;
+        }
+    }
+
+    (*temp)->size = size;
+    (*temp)->queued_at = now_ms();
+
+    timer_cancel(&(*temp)->timer);
+    timer_init(&(*temp)->timer, idle_timeout, *temp);
+    timer_arm(&(*temp)->timer, IDLE_TIMEOUT);
+
+    printf("%s has joined the queue for a %ld player room\n", (*temp)->name, size);
+    memset(msg, '\0', MAXMESSAGE + 1);
+    sprintf(msg, "Waiting for a %ld player match...\r\n", size);
+    notify_player(temp, msg, MAXMESSAGE);
+
+    move_player(*temp, &templist, &queuelist);
+
+    return 1;
+}
+
+/*
+ * handles the scenario where an incomplete ("temp") player interacts with the game
+ *
+ * handles the completion of their name (and then room size) or disconnection
+ */
+int handle_temp_player(struct player **temp) {
+    int read_name_val;
+    int watch_len = strlen(WATCH_COMMAND);
+
+    if ((*temp)->named) {
+        return handle_room_size(temp);
+    }
+    
+    // if they complete their name...
+    if ((read_name_val = read_name(*temp)) > 0) {
+        // ...unless they only want to watch
+        if (strncmp((*temp)->name, WATCH_COMMAND, watch_len) == 0 &&
+                ((*temp)->name[watch_len] == '\0' || (*temp)->name[watch_len] == ' ')) {
+            printf("New spectator is watching\n");
+
+            add_new_spectator((*temp)->fd, strtol((*temp)->name + watch_len, NULL, 10));
+            remove_player(temp, &templist);
+
+            return 1;
+        }
+
+        printf("%s has entered the lobby\n", (*temp)->name);
+        (*temp)->named = 1;
+
+        notify_player(temp, "How many players would you like to play with? (2 to 6, blank for 2)\r\n", MAXMESSAGE);
+                    
+        return 0;
+    } else if (read_name_val == -2) {
+        return 0;
+    } else if (read_name_val == 0) {
+        // ...else if the input does not complete the name
+        printf("Pending rest of name...\n");
+        
+        if ((*temp)->partial_name != NULL && (*temp)->partial_name[0] != '\0') {
+            notify_player(temp, "Pending rest of name...\r\n", MAXMESSAGE);
+        }
+
+        return 0;
+    } else {
+        printf("Player disconnected without entering full name. Could not be created\n");
+
+        remove_player(temp, &templist);
+        
+        return 1;
+    }
+}
+
+/*
+ * handles the case when a queued player does some interaction
+ * (there is nothing for them to do but wait, or disconnect)
+ *
+ * returns 1 if the player disconnected, 0 otherwise
+ */
+int handle_queued_player(struct player **queued) {
+    int player_fd = (*queued)->fd;
+    char input[MAXMESSAGE + 1];
+    int read_return;
+
+    read_return = read_input(player_fd, input, MAXMESSAGE);
+
+    // nothing was there to be read after all
+    if (no_input(read_return)) {
+        return 0;
+    }
+
+    // check to see if the player disconnected
+    if (read_return <= 0) {
+        printf("%s has left the queue\n", (*queued)->name);
+
+        remove_player(queued, &queuelist);
+
+        return 1;
+    }
+
+    timer_arm(&(*queued)->timer, IDLE_TIMEOUT);
+    notify_player_coalesced(queued, "Still waiting for a match...\r\n");
+
+    return 0;
+}
+
+/*
+ * returns 1 if there is a valid number of "active" players (in the room's playerlist).
+ * returns 0 otherwise
+ */
+int have_valid_num_players(struct room *room) {
+    if (room->playerlist != NULL && room->playerlist->next != NULL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * handles switching to the next player
+ */
+void handle_switch_player(struct player **cur_player, int extra_m, int *next_p, int *prompted) {
+    struct room *room = (*cur_player)->room;
+
+    // current_player is not changed if extra_move is true (== 1)
+    if (!extra_m) {
+        if ((*cur_player)->next != NULL) {
+            *cur_player = (*cur_player)->next;
+        } else {
+            *cur_player = room->playerlist;
+        }
+    }
+
+    // set that cur_player no longer needs to be switched and that
+    // the next player was not prompted for their move
+    *next_p = 0;
+    *prompted = 0;
+            
+    show_boards(room);
+}
+
+void handle_next_prompt(struct player **cur_player, int extra_m, int *prompted) {
+    char msg[MAXMESSAGE + 1];
+
+    if (extra_m) {
+	    printf("%s has earned another move.\n", (*cur_player)->name);
+        notify_player(cur_player, "You earned an extra turn! Please input your move.\r\n", MAXMESSAGE);
+                
+        memset(msg, '\0', MAXMESSAGE + 1);
+        sprintf(msg, "%s earned another turn!\r\n", (*cur_player)->name);
+        notify_all_other_players(cur_player, msg, MAXMESSAGE);
+    } else {
+        notify_player(cur_player, "Your turn. Please input your move.\r\n", MAXMESSAGE);
+    }
+
+    printf("Prompting %s to make their move.\n", (*cur_player)->name);
+
+    timer_arm(&(*cur_player)->timer, TURN_TIMEOUT);
+    *prompted = 1;
+}
+
+/*
+ * creates a room for the nplayers queued players in players (in seat order)
+ * and starts its game
+ */
+void create_room(struct player **players, int nplayers) {
+    struct room *new_room = Malloc(sizeof(struct room));
+    struct room *last_room = roomlist;
+    char msg[MAXMESSAGE + 1];
+
+    new_room->id = ++room_seq;
+    new_room->size = nplayers;
+    new_room->playerlist = NULL;
+    new_room->current_player = NULL;
+    new_room->next_player = 0;
+    new_room->prompted_next_player = 0;
+    new_room->spectatorlist = NULL;
+    new_room->latest_frame = NULL;
+    new_room->pending_frame = NULL;
+    new_room->next = NULL;
+
+    // keep roomlist in creation order
+    if (last_room == NULL) {
+        roomlist = new_room;
+    } else {
+        while (last_room->next != NULL) {
+            last_room = last_room->next;
+        }
+        last_room->next = new_room;
+    }
+
+    printf("Starting room %d with %d players\n", new_room->id, nplayers);
+
+    for (int i = 0; i < nplayers; i++) {
+        seat_player(players[i], new_room);
+    }
+
+    for (struct player *p = new_room->playerlist; p; p = p->next) {
+        memset(msg, '\0', MAXMESSAGE + 1);
+        sprintf(msg, "Matched into room %d with %d players (your rating: %d)\r\n",
+                new_room->id, nplayers, p->rating);
+        notify_player(&p, msg, MAXMESSAGE);
+    }
+
+    new_room->current_player = new_room->playerlist;
+    show_boards(new_room);
+
+    // waiting spectators follow the new room if they asked for it (or for any room)
+    for (struct spectator **s = &spectatorlist; *s; ) {
+        if ((*s)->watch_room == 0 || (*s)->watch_room == new_room->id) {
+            attach_spectator(s, new_room);
+        } else {
+            s = &((*s)->next);
+        }
+    }
+
+    handle_next_prompt(&new_room->current_player, 0, &new_room->prompted_next_player);
+}
+
+/*
+ * qsort comparator ordering queued players by rating
+ */
+int compare_rating(const void *a, const void *b) {
+    const struct player *p = *(struct player * const *) a;
+    const struct player *q = *(struct player * const *) b;
+
+    return p->rating - q->rating;
+}
+
+/*
+ * a single (batched) matchmaking pass over queuelist.
+ *
+ * queued players are bucketed by requested room size and sorted by rating,
+ * then every run of size neighbouring players is matched into a room when the
+ * spread of their ratings is within MATCH_SPREAD, widened by MATCH_SPREAD_GROWTH
+ * for every second the longest-waiting of them has been queued
+ */
+void match_players() {
+    int counts[MAXROOMSIZE + 1];
+    long long now = now_ms();
+    long long longest_wait;
+    int allowed_spread;
+    int nplayers, i;
+
+    if (queuelist == NULL) {
+        return;
+    }
+
+    memset(counts, 0, sizeof(counts));
+    for (struct player *p = queuelist; p; p = p->next) {
+        counts[p->size]++;
+    }
+
+    for (int size = MINROOMSIZE; size <= MAXROOMSIZE; size++) {
+        if (counts[size] < size) {
+            continue;
+        }
+
+        struct player **bucket = Malloc(counts[size] * sizeof(struct player *));
+
+        nplayers = 0;
+        for (struct player *p = queuelist; p; p = p->next) {
+            if (p->size == size) {
+                bucket[nplayers++] = p;
+            }
+        }
+
+        qsort(bucket, nplayers, sizeof(struct player *), compare_rating);
+
+        i = 0;
+        while (i + size <= nplayers) {
+            longest_wait = 0;
+            for (int j = i; j < i + size; j++) {
+                if (now - bucket[j]->queued_at > longest_wait) {
+                    longest_wait = now - bucket[j]->queued_at;
+                }
+            }
+
+            allowed_spread = MATCH_SPREAD + MATCH_SPREAD_GROWTH * (longest_wait / 1000);
+
+            if (bucket[i + size - 1]->rating - bucket[i]->rating <= allowed_spread) {
+                create_room(bucket + i, size);
+                i += size;
+            } else {
+                i++;
+            }
+        }
+
+        free(bucket);
+    }
+}
+
+/*
+ * announces the results of the room's game to its players and spectators
+ * and updates the players' ratings
+ */
+void end_game(struct room *room) {
+    char msg[MAXMESSAGE + 1];
+    int nplayers = 0;
+    size_t size;
+    struct frame *frame;
+
+    for (struct player *p = room->playerlist; p; p = p->next) {
+        nplayers++;
+    }
+
+    size = (nplayers + 1) * MAXMESSAGE + 1;
+    frame = alloc_frame(size);
+    
+    printf("Game over in room %d!\n", room->id);
+    broadcast(room, "Game over!\r\n");
+    frame->len += snprintf(frame->data + frame->len, size - frame->len, "Game over!\r\n");
+    
+    for (struct player *p = room->playerlist; p; p = p->next) {
+        memset(msg, '\0', MAXMESSAGE + 1);
+
+        printf("%s has %d points\r\n", p->name, p->points);
+        snprintf(msg, MAXMESSAGE, "%s has %d points\r\n", p->name, p->points);
+        broadcast(room, msg);
+        frame->len += snprintf(frame->data + frame->len, size - frame->len, "%s", msg);
+    }
+
+    update_ratings(room);
+
+    for (struct player *p = room->playerlist; p; p = p->next) {
+        memset(msg, '\0', MAXMESSAGE + 1);
+        sprintf(msg, "Your rating is now %d\r\n", p->rating);
+        notify_player(&p, msg, MAXMESSAGE);
+    }
+
+    release_frame(room->pending_frame);
+    room->pending_frame = frame;
+}
+
+/*
+ * closes a room whose game is over (or that no longer has enough players)
+ * and replaces it with the next room in roomlist.
+ *
+ * its remaining players are returned to the end of queuelist and its spectators
+ * go back to waiting for the next room to start
+ */
+void close_room(struct room **room) {
+    struct room *free_value = *room;
+    struct player *p;
+
+    printf("Closing room %d\n", free_value->id);
+
+    // spectators get the final frame before they detach
+    publish_frame(free_value);
+
+    while ((p = free_value->playerlist) != NULL) {
+        notify_player(&p, "Returning you to the lobby. Waiting for a new match...\r\n", MAXMESSAGE);
+
+        p->room = NULL;
+        p->queued_at = now_ms();
+        move_player(p, &free_value->playerlist, &queuelist);
+
+        timer_cancel(&p->timer);
+        timer_init(&p->timer, idle_timeout, p);
+        timer_arm(&p->timer, IDLE_TIMEOUT);
+    }
+
+    while (free_value->spectatorlist != NULL) {
+        struct spectator *s = free_value->spectatorlist;
+
+        free_value->spectatorlist = s->next;
+        s->room = NULL;
+        s->watch_room = 0;
+        s->next = spectatorlist;
+        spectatorlist = s;
+    }
+
+    release_frame(free_value->latest_frame);
+    release_frame(free_value->pending_frame);
+
+    *room = free_value->next;
+    free(free_value);
+}
+
+/*
+ * handles all interactions of the players in the room for a single loop iteration
+ *
+ * returns 1 if the room should be closed (game over or too few players), 0 otherwise
+ */
+int handle_room(struct room *room) {
+    int extra_move = 0;
+
+    // loop over every "active" player in the room's playerlist,
+    // only stopping on players that interacted with the game
+    // break the loop when handle_current_player() || handle_other_players() != 0
+    // (next is saved first, as a player who left is replaced by the next one,
+    // or by the head of the list for the last one, which was visited already)
+    for (struct player *p = room->playerlist, *next; p; p = next) {
+        next = p->next;
+
+        if (!player_ready(p)) {
+            continue;
+        }
+
+        if (p == room->current_player) {
+            if (handle_current_player(&room->current_player, &room->prompted_next_player,
+                        &room->next_player, &extra_move)) {
+                break;
+            }
+        } else if (handle_other_players(&p, &room->prompted_next_player)) {
+            break;
+        }
+    }
+
+    // the game can not go on without enough "active" players
+    if (!have_valid_num_players(room)) {
+        return 1;
+    }
+
+    // if the input move was invalid, we should return to io_wait()
+    if (extra_move == -1) {
+        return 0;
+    }
+
+    update_points(room);
+
+    if (game_is_over(room)) {
+        end_game(room);
+        return 1;
+    }
+
+    if (room->next_player) {
+        handle_switch_player(&room->current_player, extra_move, &room->next_player, &room->prompted_next_player);
+    }
+
+    // only make the preperatory prompt when no other prompts were created
+    if (!room->prompted_next_player) { 
+        handle_next_prompt(&room->current_player, extra_move, &room->prompted_next_player);
+    }
+
+    return 0;
+}
+
+/*
+ * called when a new connection took too long to finish the handshake;
+ * disconnects them
+ */
+void name_timeout(struct timer *timer) {
+    struct player *temp = timer->data;
+    int player_fd = temp->fd;
+
+    printf("A new connection took too long to finish joining. Disconnecting them\n");
+    notify_player(&temp, "You took too long to join. Goodbye\r\n", MAXMESSAGE);
+
+    Close(player_fd);
+    remove_player(&temp, &templist);
+}
+
+/*
+ * called when a queued player has been silent for too long; disconnects them
+ */
+void idle_timeout(struct timer *timer) {
+    struct player *queued = timer->data;
+
+    printf("%s has been idle for too long. Disconnecting them\n", queued->name);
+    notify_player(&queued, "You have been idle for too long. Goodbye\r\n", MAXMESSAGE);
+
+    remove_player(&queued, &queuelist);
+}
+
+/*
+ * called when the current player of a room took too long to make their move.
+ *
+ * their turn is skipped, or if they missed TURN_MAX_SKIPS turns in a row, they are
+ * removed from the room. handle_room() then switches and prompts the next player
+ */
+void turn_timeout(struct timer *timer) {
+    struct player *player = timer->data;
+    struct room *room = player->room;
+    char msg[MAXMESSAGE + 1];
+
+    if (++player->skipped_turns >= TURN_MAX_SKIPS) {
+        printf("%s missed %d turns in a row. Removing them from room %d\n",
+                player->name, player->skipped_turns, room->id);
+        notify_player(&room->current_player, "You missed too many turns. Goodbye\r\n", MAXMESSAGE);
+
+        remove_player(&room->current_player, &room->playerlist);
+
+        room->next_player = 0;
+    } else {
+        printf("%s took too long to make their move. Skipping their turn\n", player->name);
+        notify_player(&room->current_player, "You took too long. Your turn was skipped\r\n", MAXMESSAGE);
+
+        memset(msg, '\0', MAXMESSAGE + 1);
+        sprintf(msg, "%s took too long. Their turn was skipped\r\n", player->name);
+        notify_all_other_players(&room->current_player, msg, MAXMESSAGE);
+
+        room->next_player = 1;
+    }
+
+    room->prompted_next_player = 0;
+}
+
+/*
+ * returns the first dead player in list, or NULL if there is none
+ */
+struct player *find_dead_player(struct player *list) {
+    for (struct player *p = list; p; p = p->next) {
+        if (p->dead) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * tears down every player whose connection failed while being written to
+ * (see notify_player), wherever they are
+ *
+ * returns 1 if any player was removed, 0 otherwise
+ */
+int reap_dead_players() {
+    struct player *dead;
+    int player_fd;
+    int reaped = 0;
+
+    while ((dead = find_dead_player(templist)) != NULL) {
+        player_fd = dead->fd;
+        printf("Lost connection to a new player\n");
+
+        // remove_player() does not close the fds of players in templist
+        Close(player_fd);
+        remove_player(&dead, &templist);
+        reaped = 1;
+    }
+
+    while ((dead = find_dead_player(queuelist)) != NULL) {
+        player_fd = dead->fd;
+        printf("Lost connection to %s\n", dead->name);
+
+        remove_player(&dead, &queuelist);
+        reaped = 1;
+    }
+
+    for (struct room *r = roomlist; r; r = r->next) {
+        // removing a player notifies the rest of the room, which may find more dead players
+        while ((dead = find_dead_player(r->playerlist)) != NULL) {
+            player_fd = dead->fd;
+            printf("Lost connection to %s\n", dead->name);
+
+            if (dead == r->current_player) {
+                // same as the current player disconnecting (see handle_current_player)
+                remove_player(&r->current_player, &r->playerlist);
+                r->prompted_next_player = 0;
+                r->next_player = 0;
+            } else {
+                remove_player(&dead, &r->playerlist);
+            }
+
+            reaped = 1;
+        }
+    }
+
+    return reaped;
+}
+
+/*
+ * signal handler for SIGUSR1: asks the main loop for a hot upgrade
+ */
+void upgrade_signal(int sig) {
+    upgrade_requested = 1;
+}
+
+// hot upgrade state being read back (see restore_state)
+struct reader {
+    char *data;
+    size_t len;
+    size_t off;
+    int failed; // 1 once the state turned out to be malformed
+};
+
+/*
+ * appends value to the hot upgrade state buf
+ */
+void put_int(struct iobuf *buf, long long value) {
+    iobuf_append(buf, (char *) &value, sizeof(value));
+}
+
+/*
+ * appends len bytes of data to the hot upgrade state buf, preceded by len
+ */
+void put_bytes(struct iobuf *buf, const char *data, long long len) {
+    put_int(buf, len);
+    if (len > 0) {
+        iobuf_append(buf, data, len);
+    }
+}
+
+/*
+ * returns the next value of the hot upgrade state r (0 once it is malformed)
+ */
+long long get_int(struct reader *r) {
+    long long value = 0;
+
+    if (r->failed || r->len - r->off < sizeof(value)) {
+        r->failed = 1;
+        return 0;
+    }
+
+    memcpy(&value, r->data + r->off, sizeof(value));
+    r->off += sizeof(value);
+
+    return value;
+}
+
+/*
+ * returns the next bytes (stored by put_bytes) of the hot upgrade state r,
+ * setting len to their number
+ *
+ * returns NULL if they were stored with a negative length (or r is malformed)
+ */
+char *get_bytes(struct reader *r, long long *len) {
+    char *bytes;
+
+    *len = get_int(r);
+    if (r->failed || *len < 0) {
+        return NULL;
+    }
+
+    if (*len > r->len - r->off) {
+        r->failed = 1;
+        return NULL;
+    }
+
+    bytes = r->data + r->off;
+    r->off += *len;
+
+    return bytes;
+}
+
+/*
+ * reads the next string of at most MAXNAME bytes of the hot upgrade state r into str
+ *
+ * returns its length, or -1 if it was stored as missing (length -1)
+ */
+int get_string(struct reader *r, char *str) {
+    long long len;
+    char *bytes = get_bytes(r, &len);
+
+    str[0] = '\0';
+    if (bytes == NULL) {
+        return -1;
+    }
+
+    if (len > MAXNAME) {
+        r->failed = 1;
+        return -1;
+    }
+
+    memcpy(str, bytes, len);
+    str[len] = '\0';
+
+    return len;
+}
+
+/*
+ * returns the number of milliseconds until timer expires (at least 0),
+ * or -1 if it is not armed
+ */
+long long timer_remaining(struct timer *timer) {
+    long long remaining;
+
+    if (timer->pprev == NULL) {
+        return -1;
+    }
+
+    remaining = timer->expires * TIMER_TICK - now_ms();
+
+    return remaining < 0 ? 0 : remaining;
+}
+
+/*
+ * appends the connection fd to buf as its index in fds (adding it there),
+ * followed by the bytes still queued for it and those received but not read yet
+ */
+void put_conn(struct iobuf *buf, struct fdlist *fds, int fd) {
+    struct fdstate *st = fd_state(fd);
+
+    put_int(buf, fds->len);
+    fdlist_push(fds, fd);
+
+    put_int(buf, st->failed);
+    put_bytes(buf, st->out.data + st->out.off, iobuf_pending(&st->out));
+    put_bytes(buf, st->in.data + st->in.off, iobuf_pending(&st->in));
+}
+
+/*
+ * reads a connection stored by put_conn, with fds the fds passed along
+ *
+ * returns its fd, or -1 if r is malformed
+ */
+int get_conn(struct reader *r, int *fds, int nfds) {
+    long long index = get_int(r);
+    long long len;
+    char *bytes;
+    struct fdstate *st;
+    int fd;
+
+    // fds[0] is the listening socket
+    if (r->failed || index < 1 || index >= nfds) {
+        r->failed = 1;
+        return -1;
+    }
+
+    fd = fds[index];
+    st = fd_state(fd);
+    st->failed = get_int(r) != 0;
+
+    // (connections accepted by an older server may still be blocking)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if ((bytes = get_bytes(r, &len)) != NULL && len > 0) {
+        iobuf_append(&st->out, bytes, len);
+        mark_dirty(fd);
+    }
+
+    // the input is read (once the fd is watched) as if it had just arrived
+    if ((bytes = get_bytes(r, &len)) != NULL && len > 0) {
+        iobuf_append(&st->in, bytes, len);
+        mark_ready(fd);
+    }
+
+    return fd;
+}
+
+/*
+ * appends a frame (NULL included) to buf
+ */
+void put_frame(struct iobuf *buf, struct frame *frame) {
+    if (frame == NULL) {
+        put_int(buf, -1);
+        return;
+    }
+
+    put_bytes(buf, frame->data, frame->len);
+    put_int(buf, frame->seq);
+}
+
+/*
+ * reads a frame stored by put_frame
+ *
+ * returns the new frame (holding one reference for the caller), or NULL
+ */
+struct frame *get_frame(struct reader *r) {
+    long long len;
+    char *bytes = get_bytes(r, &len);
+    struct frame *frame;
+
+    if (bytes == NULL) {
+        return NULL;
+    }
+
+    frame = alloc_frame(len + 1);
+    memcpy(frame->data, bytes, len);
+    frame->data[len] = '\0';
+    frame->len = len;
+    frame->seq = get_int(r);
+
+    return frame;
+}
+
+/*
+ * appends a player (and their connection) to buf
+ */
+void put_player(struct iobuf *buf, struct fdlist *fds, struct player *player) {
+    put_conn(buf, fds, player->fd);
+
+    put_bytes(buf, player->name, strlen(player->name));
+    if (player->partial_name != NULL) {
+        put_bytes(buf, player->partial_name, strlen(player->partial_name));
+    } else {
+        put_int(buf, -1);
+    }
+
+    for (int i = 0; i <= NPITS; i++) {
+        put_int(buf, player->pits[i]);
+    }
+    put_int(buf, player->points);
+    put_int(buf, player->rating);
+    put_int(buf, player->named);
+    put_int(buf, player->size);
+    put_int(buf, player->skipped_turns);
+    put_int(buf, player->dead);
+    put_int(buf, player->queued_at - now_ms());
+    put_int(buf, timer_remaining(&player->timer));
+}
+
+/*
+ * reads a player stored by put_player and adds them to the end of list,
+ * seated in room (NULL if none), with their timer calling callback
+ *
+ * returns the new player, or NULL if r is malformed
+ */
+struct player *get_player(struct reader *r, int *fds, int nfds, struct player **list,
+                          void (*callback)(struct timer *), struct room *room) {
+    char str[MAXNAME + 1];
+    struct player *player;
+    long long remaining;
+    int fd;
+
+    if ((fd = get_conn(r, fds, nfds)) == -1) {
+        return NULL;
+    }
+
+    add_new_player(fd, list);
+    player = get_newest_player(list);
+
+    if (get_string(r, str) > 0) {
+        player->name = name_intern(str);
+    }
+    if (get_string(r, str) >= 0) {
+        player->partial_name = block_get();
+        strcpy(player->partial_name, str);
+    }
+
+    for (int i = 0; i <= NPITS; i++) {
+        player->pits[i] = get_int(r);
+    }
+    player->points = get_int(r);
+    player->rating = get_int(r);
+    player->named = get_int(r);
+    player->size = get_int(r);
+    player->skipped_turns = get_int(r);
+    player->dead = get_int(r);
+    player->queued_at = now_ms() + get_int(r);
+    player->room = room;
+
+    timer_init(&player->timer, callback, player);
+    if ((remaining = get_int(r)) >= 0) {
+        timer_arm(&player->timer, remaining);
+    }
+
+    return player;
+}
+
+/*
+ * appends a spectator (and their connection) to buf
+ *
+ * only the unsent rest of the frame they are in the middle of is kept
+ */
+void put_spectator(struct iobuf *buf, struct fdlist *fds, struct spectator *spectator) {
+    put_conn(buf, fds, spectator->fd);
+
+    put_int(buf, spectator->watch_room);
+    put_int(buf, spectator->sent_seq);
+    put_int(buf, spectator->lag);
+
+    if (spectator->frame != NULL) {
+        put_bytes(buf, spectator->frame->data + spectator->sent, spectator->frame->len - spectator->sent);
+        put_int(buf, spectator->sent_seq);
+    } else {
+        put_int(buf, -1);
+    }
+}
+
+/*
+ * reads a spectator stored by put_spectator and adds them to the end of list,
+ * watching room (NULL while waiting for one)
+ *
+ * returns 0 on success, -1 if r is malformed
+ */
+int get_spectator(struct reader *r, int *fds, int nfds, struct spectator **list, struct room *room) {
+    struct spectator *spectator;
+    int fd;
+
+    if ((fd = get_conn(r, fds, nfds)) == -1) {
+        return -1;
+    }
+
+    spectator = Malloc(sizeof(struct spectator));
+    spectator->fd = fd;
+    spectator->watch_room = get_int(r);
+    spectator->sent_seq = get_int(r);
+    spectator->lag = get_int(r);
+    spectator->frame = get_frame(r);
+    spectator->sent = 0;
+    spectator->room = room;
+    spectator->next = NULL;
+
+    while (*list) {
+        list = &((*list)->next);
+    }
+    *list = spectator;
+
+    return 0;
+}
+
+/*
+ * appends the state of the whole server to buf: the players in every list,
+ * the rooms and spectators, and everything in flight on their connections
+ *
+ * the fds referred to are collected in fds, starting with listenfd
+ */
+void save_state(struct iobuf *buf, struct fdlist *fds) {
+    int count;
+
+    fdlist_push(fds, listenfd);
+
+    put_int(buf, room_seq);
+    put_int(buf, frame_seq);
+    put_int(buf, next_match - now_ms());
+    put_int(buf, accept_backoff);
+    put_int(buf, timer_remaining(&accept_timer));
+
+    count = 0;
+    for (struct player *p = templist; p; p = p->next) {
+        count++;
+    }
+    put_int(buf, count);
+    for (struct player *p = templist; p; p = p->next) {
+        put_player(buf, fds, p);
+    }
+
+    count = 0;
+    for (struct player *p = queuelist; p; p = p->next) {
+        count++;
+    }
+    put_int(buf, count);
+    for (struct player *p = queuelist; p; p = p->next) {
+        put_player(buf, fds, p);
+    }
+
+    count = 0;
+    for (struct room *r = roomlist; r; r = r->next) {
+        count++;
+    }
+    put_int(buf, count);
+    for (struct room *r = roomlist; r; r = r->next) {
+        int current = -1;
+
+        count = 0;
+        for (struct player *p = r->playerlist; p; p = p->next) {
+            if (p == r->current_player) {
+                current = count;
+            }
+            count++;
+        }
+
+        put_int(buf, r->id);
+        put_int(buf, r->size);
+        put_int(buf, r->next_player);
+        put_int(buf, r->prompted_next_player);
+        put_int(buf, current);
+        put_frame(buf, r->latest_frame);
+        put_frame(buf, r->pending_frame);
+
+        put_int(buf, count);
+        for (struct player *p = r->playerlist; p; p = p->next) {
+            put_player(buf, fds, p);
+        }
+
+        count = 0;
+        for (struct spectator *s = r->spectatorlist; s; s = s->next) {
+            count++;
+        }
+        put_int(buf, count);
+        for (struct spectator *s = r->spectatorlist; s; s = s->next) {
+            put_spectator(buf, fds, s);
+        }
+    }
+
+    count = 0;
+    for (struct spectator *s = spectatorlist; s; s = s->next) {
+        count++;
+    }
+    put_int(buf, count);
+    for (struct spectator *s = spectatorlist; s; s = s->next) {
+        put_spectator(buf, fds, s);
+    }
+}
+
+/*
+ * rebuilds the server from the state stored by save_state(), with fds the
+ * fds it collected (as received by this process)
+ *
+ * the connections are not watched yet (see take_over)
+ *
+ * returns 0 on success, -1 if the state is malformed
+ */
+int restore_state(struct reader *r, int *fds, int nfds) {
+    long long remaining;
+
+    listenfd = fds[0];
+    fd_state(listenfd)->listener = 1;
+
+    room_seq = get_int(r);
+    frame_seq = get_int(r);
+    next_match = now_ms() + get_int(r);
+    accept_backoff = get_int(r);
+    if ((remaining = get_int(r)) >= 0) {
+        timer_arm(&accept_timer, remaining);
+    }
+
+    for (long long n = get_int(r); n > 0 && !r->failed; n--) {
+        get_player(r, fds, nfds, &templist, name_timeout, NULL);
+    }
+
+    for (long long n = get_int(r); n > 0 && !r->failed; n--) {
+        get_player(r, fds, nfds, &queuelist, idle_timeout, NULL);
+    }
+
+    for (long long n = get_int(r); n > 0 && !r->failed; n--) {
+        struct room *room = Malloc(sizeof(struct room));
+        struct room **last = &roomlist;
+        long long current;
+
+        room->id = get_int(r);
+        room->size = get_int(r);
+        room->next_player = get_int(r);
+        room->prompted_next_player = get_int(r);
+        current = get_int(r);
+        room->latest_frame = get_frame(r);
+        room->pending_frame = get_frame(r);
+        room->playerlist = NULL;
+        room->current_player = NULL;
+        room->spectatorlist = NULL;
+        room->next = NULL;
+
+        // keep roomlist in creation order
+        while (*last) {
+            last = &((*last)->next);
+        }
+        *last = room;
+
+        for (long long i = get_int(r); i > 0 && !r->failed; i--) {
+            struct player *player = get_player(r, fds, nfds, &room->playerlist, turn_timeout, room);
+
+            if (current-- == 0) {
+                room->current_player = player;
+            }
+        }
+
+        for (long long i = get_int(r); i > 0 && !r->failed; i--) {
+            get_spectator(r, fds, nfds, &room->spectatorlist, room);
+        }
+
+        if (room->current_player == NULL) {
+            r->failed = 1;
+        }
+    }
+
+    for (long long n = get_int(r); n > 0 && !r->failed; n--) {
+        get_spectator(r, fds, nfds, &spectatorlist, NULL);
+    }
+
+    return r->failed || r->off != r->len ? -1 : 0;
+}
+
+/*
+ * passes the n (at most UPGRADE_FDS_PER_MSG) fds in fds over the UNIX
+ * domain socket sock, in a single message
+ *
+ * returns 0 on success, -1 on failure
+ */
+int send_fds(int sock, int *fds, int n) {
+    char control[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    iov.iov_base = &n;
+    iov.iov_len = sizeof(n);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * receives the fds of one message sent by send_fds into fds (room for max)
+ *
+ * returns the number of fds received, or -1 on failure
+ */
+int recv_fds(int sock, int *fds, int max) {
+    char control[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int n;
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = &n;
+    iov.iov_len = sizeof(n);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, 0) <= 0) {
+        perror("recvmsg");
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if ((msg.msg_flags & MSG_CTRUNC) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (n > max) {
+        return -1;
     }
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+
+    return n;
 }
 
 /*
- * updates all players' counts of points
+ * remembers the absolute path of the server binary (started as argv0), so
+ * that hot_upgrade() executes the binary found there by then, no matter
+ * $PATH or the working directory at that time
  */
-void update_points() {
-    int points;
-    
-    for (struct player *p = playerlist; p; p = p->next) {
-        points = 0;
+void save_exe_path(char *argv0) {
+    char cwd[PATH_MAX];
+    char exe[PATH_MAX];
+    ssize_t len;
 
-        for (int i = 0; i <= NPITS; i++) {
-            points += p->pits[i];
-        }
-        
-        p->points = points;
+    if (argv0[0] == '/') {
+        exe_path = argv0;
+    } else if (strchr(argv0, '/') != NULL && getcwd(cwd, sizeof(cwd)) != NULL) {
+        // symlinks are kept, so a link pointed at a new build picks it up
+        exe_path = Malloc(strlen(cwd) + strlen(argv0) + 2);
+        sprintf(exe_path, "%s/%s", cwd, argv0);
+    } else if ((len = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) != -1) {
+        // found through $PATH
+        exe[len] = '\0';
+        exe_path = Malloc(len + 1);
+        memcpy(exe_path, exe, len + 1);
+    } else {
+        perror("readlink");
     }
-
 }
 
 /*
- * makes the necessary adjustments to game boards/struct players
- * based on the input move and returns 1 if the player
- * has earned an extra move, 0 if not and -1 if the move was invalid.
- * 
- * if the input move is invalid, the player is notified of
- * such and prompted to try again
+ * (in the child of hot_upgrade) executes the server binary anew, with the
+ * original arguments plus -U sock
+ *
+ * only returns if that failed
  */
-int make_move(struct player **cur_player, char *input) {
-    int move = strtol(input, NULL, 10);
-    int pebbles = (*cur_player)->pits[move];
-    struct player *modded_player = *cur_player;
- 
-    if (pebbles == 0 || move >= NPITS || move < 0) {
-        printf("Player input an invalid move: %d. Prompting for new move\n", move);
-        notify_player(cur_player, "That move is invalid. Please input the index to a non-end pit (pit must have 1+ pebbles)\r\n", MAXMESSAGE);
-        
-        return -1;
+void exec_upgrade(int sock) {
+    char **argv;
+    char fd_arg[16];
+    int argc = 0;
+    int n = 0;
+
+    while (saved_argv[n] != NULL) {
+        n++;
     }
+    argv = Malloc((n + 3) * sizeof(char *));
 
-    // selected pit is emptied
-    modded_player->pits[move] = 0;
-    
-    while (pebbles > 0) {
-        move++;
-
-        // if we are modifying the current player and we have not traversed
-        // past their end pit OR we are modifying any other player and
-        // we have not reached their end pit...
-        if ((modded_player == *cur_player && move <= NPITS) ||
-                (modded_player != *cur_player && move < NPITS)) {
-            modded_player->pits[move] += 1;
-        } else {
-            // ...else switch players to modify and empty their first non-end pit
-            if (modded_player->next != NULL) {
-                modded_player = modded_player->next;
-            } else {
-                modded_player = playerlist;
-            }
-            move = 0;
-            modded_player->pits[move] += 1;
+    // a server that was upgraded to itself got a -U of its own
+    for (int i = 0; i < n; i++) {
+        if (strcmp(saved_argv[i], "-U") == 0 && i + 1 < n) {
+            i++;
+            continue;
         }
-        pebbles--;
+        argv[argc++] = saved_argv[i];
     }
-    
-    // extra_m (extra_move) is updated to 1 (indicating extra move earned)
-    // if the last pebble was placed in the current player's end pit
-    if (modded_player == *cur_player && move == NPITS) {
-        return 1;
+
+    snprintf(fd_arg, sizeof(fd_arg), "%d", sock);
+    argv[argc++] = "-U";
+    argv[argc++] = fd_arg;
+    argv[argc] = NULL;
+
+    // nothing but sock is inherited, everything else is passed along explicitly
+    if ((sock > 3 && syscall(__NR_close_range, 3, sock - 1, 0) == -1)
+            || syscall(__NR_close_range, sock + 1, ~0U, 0) == -1) {
+        for (int fd = 3; fd < sysconf(_SC_OPEN_MAX); fd++) {
+            if (fd != sock) {
+                close(fd);
+            }
+        }
     }
-    return 0;
+
+    execv(exe_path, argv);
+    perror("execv");
 }
 
 /*
- * handles the scenario when a new player connects.
- * 
- * prompts the player for a name and adds them to the end of templist
+ * sends the handoff (a header, the fds, then the state) to the new server
+ * over sock and waits for it to report that it restored everything
  *
- * this player is not added to playerlist ("activated") until a complete name is received
+ * returns 0 once the new server is ready, -1 on failure
  */
-void handle_player_creation(int *max_fd, fd_set *all_fds) {
-    int new_player_fd = Accept(listenfd, NULL, NULL);
-    char *name = Malloc(MAXNAME + 1);
-    // temp is used since a struct player pointer is required to notify connected
-    // players (simpler implementation)
-    struct player *temp = malloc(sizeof(struct player));
-    
-    memset(name, '\0', MAXNAME + 1);
-    temp->fd = new_player_fd;
-    
-    // update the max_fd to be used by FD_ISSET
-    if (new_player_fd > *max_fd) {
-        *max_fd = new_player_fd;
+int handoff(int sock, struct iobuf *state, struct fdlist *fds) {
+    long long header[4] = { UPGRADE_MAGIC, UPGRADE_VERSION, fds->len, iobuf_pending(state) };
+    struct timeval tv = { UPGRADE_TIMEOUT / 1000, (UPGRADE_TIMEOUT % 1000) * 1000 };
+    size_t off, len;
+    char ready;
+
+    // a new server that hangs must not hang this one
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (send(sock, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header)) {
+        perror("send");
+        return -1;
     }
 
-    printf("New player connected. Prompting for name\n");
-    notify_player(&temp, "Welcome to Mancala. What is your name?\r\n", MAXMESSAGE);
-    
-    add_new_player(new_player_fd, name, &templist);
-    
-    FD_SET(new_player_fd, all_fds);
+    for (int i = 0; i < fds->len; i += UPGRADE_FDS_PER_MSG) {
+        int n = fds->len - i < UPGRADE_FDS_PER_MSG ? fds->len - i : UPGRADE_FDS_PER_MSG;
 
-    free(temp);
-}
+        if (send_fds(sock, fds->fds + i, n) == -1) {
+            return -1;
+        }
+    }
 
-/*
- * handles the case when the current player does some interaction
- * (enters a move or disconnects)
- * 
- * returns 0 if the current player != NULL, returns 1 otherwise and
- * returns -1 if extra_m == -1 (indicating an invalid input move)
- */
-int handle_current_player(struct player **cur_player, fd_set *all_fds, int *prompted, int *next_p, int *extra_m) {
-    int clear_value;
-    int player_fd = (*cur_player)->fd;
-    char input[MAXMESSAGE + 1];
-    char msg[MAXMESSAGE + 1];
-    
-    // check to see if the player disconnected
-    if (read_input(player_fd, input, MAXMESSAGE) == 0) {
-        clear_value = player_fd;
-        remove_player(cur_player, &playerlist);
-        FD_CLR(clear_value, all_fds);
-        
-        // set to indicate that the (new) current player was not prompted,
-        // the current player does not need to be switched and the
-        // the current player did not earn a new move
-        *prompted = 0;
-        *next_p = 0;
-        *extra_m = 0;
-                      
-        if (cur_player == NULL) {
-            return 1;
-        } else {
-            return 0;
+    for (off = 0; off < iobuf_pending(state); off += len) {
+        len = iobuf_pending(state) - off < UPGRADE_CHUNK ? iobuf_pending(state) - off : UPGRADE_CHUNK;
+
+        if (send(sock, state->data + state->off + off, len, MSG_NOSIGNAL) != len) {
+            perror("send");
+            return -1;
         }
-    } else if (playerlist->next == NULL) {
-        // if cur_player is the only player...
-        notify_player(cur_player, "Waiting for more players...\r\n", MAXMESSAGE);
-        return 0;
     }
-    
-    // if the input move is invalid...
-    if ((*extra_m = make_move(cur_player, input)) == -1) {
+
+    if (recv(sock, &ready, 1, 0) != 1 || ready != 'R') {
         return -1;
     }
 
-    // indicate it is the next player's turn
-    *next_p = 1;
-
-    printf("%s made a move: %s\n", (*cur_player)->name, input); 
-    memset(msg, '\0', MAXMESSAGE + 1);
-    sprintf(msg, "%s made a move: %s\r\n", (*cur_player)->name, input);
-    notify_all_other_players(cur_player, msg, MAXMESSAGE);
-                         
     return 0;
 }
 
 /*
- * handles the case when a player other than the current player does some interaction
- * 
- * returns 1 if opter_p == NULL; returns 0 otherwise
+ * replaces this server with a freshly executed instance of its binary (SIGUSR1),
+ * handing the listening socket, every connection and the state of all players,
+ * rooms and spectators over a UNIX domain socket
+ *
+ * this server exits once the new one restored everything; if the new one
+ * fails to, it is killed and this server carries on as if nothing happened
  */
-int handle_other_players(struct player **other_p, fd_set *all_fds, int *prompted) {
-    int player_fd = (*other_p)->fd;
-    char input[MAXMESSAGE + 1];
-    
-    // check to see if the player disconnected
-    if (read_input(player_fd, input, MAXMESSAGE) == 0) {
-        remove_player(other_p, &playerlist);
-        FD_CLR(player_fd, all_fds);
-        
-        *prompted = 0;
-                    
-        if (*other_p == NULL) {
-            return 1;
-        }
-        return 0;
+void hot_upgrade() {
+    struct iobuf state;
+    struct fdlist fds;
+    int sv[2];
+    pid_t pid;
+
+    printf("Hot upgrade requested. Handing over to a new server\n");
+
+    if (exe_path == NULL) {
+        printf("The path of the server binary is unknown. Hot upgrade cancelled\n");
+        return;
     }
 
-    printf("%s played out of turn. Advising them to wait their turn\r\n", (*other_p)->name);
-    notify_player(other_p, "Please wait your turn\r\n", MAXMESSAGE);
+    // everything received so far must be in the input buffers, and
+    // connections accepted so far must be players
+    io_flush();
+    if (io_quiesce(UPGRADE_TIMEOUT) == -1) {
+        printf("I/O did not settle in time. Hot upgrade cancelled\n");
+        io_resume();
+        return;
+    }
+    while (accepted_fds.len > 0) {
+        handle_player_creation();
+    }
 
-    return 0;
-}
+    memset(&state, 0, sizeof(state));
+    memset(&fds, 0, sizeof(fds));
+    save_state(&state, &fds);
 
-/*
- * handles the scenario where an incomplete ("temp") player interacts with the game
- *
- * handles the completion of their name or disconnection
- */
-int handle_temp_player(struct player **temp, struct player **cur_player, int *prompted, fd_set *all_fds) {
-    int read_name_val;
-    
-    // if they complete their name...
-    if ((read_name_val = read_name((*temp)->fd, (*temp)->name, all_fds)) > 0) {
-        printf("%s has joined the game\n", (*temp)->name);
-        broadcast("New player joined!\r\n");
-                    
-        add_new_player((*temp)->fd, (*temp)->name, &playerlist); 
-        remove_player(temp, &templist);
- 
-        if (*cur_player == NULL) {
-            *cur_player = playerlist;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        perror("socketpair");
+        pid = -1;
+    } else {
+        fflush(stdout);
+
+        if ((pid = fork()) == -1) {
+            perror("fork");
+            close(sv[0]);
+            close(sv[1]);
+        } else if (pid == 0) {
+            close(sv[0]);
+            exec_upgrade(sv[1]);
+            _exit(1);
+        } else {
+            close(sv[1]);
         }
+    }
 
-        show_boards();
+    if (pid > 0 && handoff(sv[0], &state, &fds) == 0) {
+        printf("Handed over to the new server (pid %d). Exiting\n", (int) pid);
 
-        *prompted = 0;
-                    
-        return 1;
-    } else if (read_name_val == 0) {
-        // ...else if the input does not complete the name
-        printf("Pending rest of name...\n");
-        
-        if (strlen((*temp)->name) > 0) {
-            notify_player(temp, "Pending rest of name...\r\n", MAXMESSAGE);
+        if (trace_path != NULL) {
+            trace_dump(0);
         }
 
-        return 0;
-    } else {
-        printf("Player disconnected without entering full name. Could not be created\n");
+        // the connections live on in the new server, so nothing is closed
+        exit(0);
+    }
 
-        remove_player(temp, &templist);
-        
-        return 1;
+    printf("The new server failed to take over. Hot upgrade cancelled\n");
+
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sv[0]);
     }
+
+    iobuf_free(&state);
+    free(fds.fds);
+    io_resume();
 }
 
 /*
- * returns 1 if there is a valid number of "active" players (in playerlist).
- * returns 0 otherwise
+ * takes over from the server that executed this one (-U), restoring what it
+ * handed over on sock, and starts watching the connections once it is gone;
+ * exits if the handoff fails (the old server then carries on)
  */
-int have_valid_num_players() {
-    if (playerlist != NULL && playerlist->next != NULL) {
-        return 1;
+void take_over(int sock) {
+    long long header[4];
+    struct reader r;
+    int *fds;
+    int nfds = 0;
+    ssize_t n;
+    char eof;
+
+    if (recv(sock, header, sizeof(header), 0) != sizeof(header)
+            || header[0] != UPGRADE_MAGIC || header[1] != UPGRADE_VERSION || header[2] < 1) {
+        fprintf(stderr, "Unexpected handoff from the previous server\n");
+        exit(1);
     }
-    return 0;
-}
 
-/*
- * handles switching to the next player
- */
-void handle_switch_player(struct player **cur_player, int extra_m, int *next_p, int *prompted) {
-    // current_player is not changed if extra_move is true (== 1)
-    if (!extra_m) {
-        if ((*cur_player)->next != NULL) {
-            *cur_player = (*cur_player)->next;
-        } else {
-            *cur_player = playerlist;
+    fds = Malloc(header[2] * sizeof(int));
+    while (nfds < header[2]) {
+        if ((n = recv_fds(sock, fds + nfds, header[2] - nfds)) <= 0) {
+            fprintf(stderr, "Failed to receive the connections of the previous server\n");
+            exit(1);
         }
+        nfds += n;
     }
 
-    // set that cur_player no longer needs to be switched and that
-    // the next player was not prompted for their move
-    *next_p = 0;
-    *prompted = 0;
-            
-    show_boards();
-}
-
-void handle_next_prompt(struct player **cur_player, int extra_m, int *prompted) {
-    char msg[MAXMESSAGE + 1];
+    // each chunk is a message of its own, received whole
+    memset(&r, 0, sizeof(r));
+    r.len = header[3];
+    r.data = Malloc(r.len + 1);
+    while (r.off < r.len) {
+        if ((n = recv(sock, r.data + r.off, r.len - r.off, 0)) <= 0) {
+            fprintf(stderr, "Failed to receive the state of the previous server\n");
+            exit(1);
+        }
+        r.off += n;
+    }
+    r.off = 0;
 
-    if (extra_m) {
-	    printf("%s has earned another move.\n", (*cur_player)->name);
-        notify_player(cur_player, "You earned an extra turn! Please input your move.\r\n", MAXMESSAGE);
-                
-        memset(msg, '\0', MAXMESSAGE + 1);
-        sprintf(msg, "%s earned another turn!\r\n", (*cur_player)->name);
-        notify_all_other_players(cur_player, msg, MAXMESSAGE);
-    } else {
-        notify_player(cur_player, "Your turn. Please input your move.\r\n", MAXMESSAGE);
+    if (restore_state(&r, fds, nfds) == -1) {
+        fprintf(stderr, "Malformed state handed over by the previous server\n");
+        exit(1);
     }
 
-    printf("Prompting %s to make their move.\n", (*cur_player)->name);
+    // the previous server exits once it reads that this one is ready
+    if (send(sock, "R", 1, MSG_NOSIGNAL) != 1 || recv(sock, &eof, 1, 0) != 0) {
+        fprintf(stderr, "The previous server did not hand over\n");
+        exit(1);
+    }
+    Close(sock);
 
-    *prompted = 1;
-}
+    // the listening socket stays unwatched while accepting is backed off
+    if (accept_timer.pprev == NULL) {
+        io_watch(listenfd);
+    }
+    for (int i = 1; i < nfds; i++) {
+        io_watch(fds[i]);
+    }
 
-void end_game() {
-    char msg[MAXMESSAGE + 1];
-    
-    printf("Game over!\n");
-    broadcast("Game over!\r\n");
-    
-    for (struct player *p = playerlist; p; p = p->next) {
-        memset(msg, '\0', MAXMESSAGE + 1);
+    printf("Took over %d connections from the previous server\n", nfds - 1);
 
-        printf("%s has %d points\r\n", p->name, p->points);
-        snprintf(msg, MAXMESSAGE, "%s has %d points\r\n", p->name, p->points);
-        broadcast(msg);
-    }
+    free(r.data);
+    free(fds);
 }
 
 int main(int argc, char **argv) {
-    int max_fd, extra_move;
-    int next_player = 0;
-    int prompted_next_player = 0;
-    struct player *current_player = NULL;
-    fd_set all_fds;
+    long long wait, match_wait;
+    long long iteration = 0;
+    long long start;
     
     // prepare server for listening on the correct port (as per cmd line arguments) 
+    // (unless the listening socket is handed over by the previous server)
+    saved_argv = argv;
+    save_exe_path(argv[0]);
     parseargs(argc, argv);
-    makelistener();
+    if (upgrade_fd == -1) {
+        makelistener();
+    }
+
+    // writing to a player that has gone away must only fail that write
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, upgrade_signal);
+
+    if (trace_path != NULL) {
+        signal(SIGUSR2, trace_signal);
+        signal(SIGINT, trace_signal);
+        signal(SIGTERM, trace_signal);
+    }
+
+    reserve_fd = open("/dev/null", O_RDONLY);
+    timer_init(&accept_timer, resume_accept, NULL);
+    timer_init(&stats_timer, log_dropped_input, NULL);
+
+    io_init();
+    wheel_tick = now_ms() / TIMER_TICK;
 
-    // set up the fd_set of all players + the listening fd
-    max_fd = listenfd;
-    FD_ZERO(&all_fds);
-    FD_SET(listenfd, &all_fds);
+    // players and spectators are watched as they connect, the listening fd right away
+    if (upgrade_fd != -1) {
+        take_over(upgrade_fd);
+    } else {
+        io_watch_listener(listenfd);
+    }
 
     printf("Mancala server started. Waiting for players...\n");
 
-    while (!game_is_over()) {
-        // reset dynamic_fds every loop since it will be modified by Select
-        fd_set dynamic_fds = all_fds;
-        extra_move = 0;
-        
-        Select(max_fd + 1, &dynamic_fds, NULL, NULL, NULL);
-        
-        // if a new player connects...
-        if (FD_ISSET(listenfd, &dynamic_fds)) {
-            handle_player_creation(&max_fd, &all_fds);
-            
-            if (!have_valid_num_players()) {
-                printf("Waiting for more players...\n");
-                continue;
+    while (!quit_requested) {
+        int reaped = reap_dead_players();
+
+        if (dump_requested) {
+            dump_requested = 0;
+            trace_dump(0);
+        }
+
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            hot_upgrade();
+        }
+
+        // spectators get (at most) one frame per room per loop iteration
+        for (struct room *r = roomlist; r; r = r->next) {
+            publish_frame(r);
+        }
+
+        // only spectators with a frame still in progress are waited on for writing
+        set_pending_spectators(spectatorlist);
+        for (struct room *r = roomlist; r; r = r->next) {
+            set_pending_spectators(r->spectatorlist);
+        }
+
+        // wake up for the next matchmaking pass while anyone is queued
+        // and whenever the timer wheel needs turning
+        wait = timers_next_timeout();
+        if (queuelist != NULL) {
+            match_wait = next_match - now_ms();
+            if (match_wait < 0) {
+                match_wait = 0;
+            }
+            if (wait == -1 || match_wait < wait) {
+                wait = match_wait;
             }
         }
-        
-        // loop over every "active" player in playerlist,
+
+        // rooms that lost players must be handled without waiting for any input
+        if (reaped) {
+            wait = 0;
+        }
+
+        // everything written during the last iteration goes out in one batch
+        // (with io_uring, submitted together with the wait in a single syscall)
+        io_flush();
+
+        start = trace_begin();
+        io_wait(wait);
+        trace_end("wait", start, 0, -1);
+
+        iteration++;
+        PROBE3(loop, iteration, ready_fds.len, wait);
+        start = trace_begin();
+
+        handle_spectators(&spectatorlist);
+        for (struct room *r = roomlist; r; r = r->next) {
+            handle_spectators(&r->spectatorlist);
+        }
+
+        // loop over every player waiting in queuelist,
         // only stopping on players that interacted with the game
-        // break the loop when handle_current_player() || handle_other_players() != 0
-        for (struct player *p = playerlist; p; p = p->next) {
-            if (p->fd == current_player->fd && FD_ISSET(p->fd, &dynamic_fds)) {
-                if (handle_current_player(&current_player, &all_fds, &prompted_next_player, &next_player, &extra_move)) {
-                    break;
-                }
-            } else if (FD_ISSET(p->fd, &dynamic_fds)) {
-                if (handle_other_players(&p, &all_fds, &prompted_next_player)) {
+        // break the loop if handle_queued_player() != 0
+        // (done before templist, so players that just joined the queue aren't read twice)
+        for (struct player *q = queuelist; q; q = q->next) {
+            if (player_ready(q)) {
+                if (handle_queued_player(&q)) {
                     break;
                 }
             }
         }
-        
-        // if the input move was invalid, we should return to Select()
-        if (extra_move == -1) {
-            continue;
-        }
 
         // loop over every player in templist,
         // only stopping on players that interacted with the game
         // break the loop if handle_temp_player() != 0
         for (struct player *t = templist; t; t = t->next) {
-            if (FD_ISSET(t->fd, &dynamic_fds)) {
-                if (handle_temp_player(&t, &current_player, &prompted_next_player, &all_fds)) {
+            if (player_ready(t)) {
+                if (handle_temp_player(&t)) {
                     break;
                 }
             }
         }
-        
-        // should return to Select if we do not have enough "active" players
-        if (!have_valid_num_players()) {
-            continue;
-        }
 
-        update_points();
+        // timers fire before the rooms are handled, so that handle_room()
+        // can move on from any turns that timed out
+        timers_advance();
+
+        for (struct room **r = &roomlist; *r; ) {
+            long long room_start = trace_begin();
+            int room_id = (*r)->id;
+            int closing = handle_room(*r);
+
+            trace_end("room", room_start, room_id, -1);
+
+            if (closing) {
+                close_room(r);
+            } else {
+                r = &((*r)->next);
+            }
+        }
 
-        if (next_player) {
-            handle_switch_player(&current_player, extra_move, &next_player, &prompted_next_player);
+        // if a new player connects...
+        // (handled after everyone else, so players accepted now are first read next iteration)
+        if (io_ready(listenfd)) {
+            handle_player_creation();
         }
 
-        // only make the preperatory prompt when no other prompts were created
-        // and when there is a valid number of players
-        if (!prompted_next_player && have_valid_num_players()) { 
-            handle_next_prompt(&current_player, extra_move, &prompted_next_player);
+        if (now_ms() >= next_match) {
+            match_players();
+            next_match = now_ms() + MATCH_INTERVAL;
         }
+
+        trace_end("iteration", start, 0, -1);
+    }
+
+    if (trace_path != NULL) {
+        trace_dump(1);
     }
-    
-    end_game();
 
     return 0;
 }
@@ -778,17 +4652,27 @@ int main(int argc, char **argv) {
  */
 void parseargs(int argc, char **argv) {
     int c, status = 0;
-    while ((c = getopt(argc, argv, "p:")) != EOF) {
+    while ((c = getopt(argc, argv, "p:uT:U:")) != EOF) {
         switch (c) {
         case 'p':
             port = strtol(optarg, NULL, 0);  
             break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'U':
+            // only passed by hot_upgrade() to the server taking over
+            upgrade_fd = strtol(optarg, NULL, 0);
+            break;
         default:
             status++;
         }
     }
     if (status || optind != argc) {
-        fprintf(stderr, "usage: %s [-p port]\n", argv[0]);
+        fprintf(stderr, "usage: %s [-p port] [-u] [-T trace.json]\n", argv[0]);
         exit(1);
     }
 }
@@ -821,68 +4705,54 @@ void makelistener() {
         exit(1);
     }
 
-    if (listen(listenfd, 5)) {
+    if (listen(listenfd, SOMAXCONN)) {
         perror("listen");
         exit(1);
     }
+
+    // new players are accepted in batches, until there are none left
+    if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
 }
 
 
 
 /* 
  * calculates and returns the average number of pebbles in all "active" players'
- * non-end pits
+ * non-end pits in the room
  *
- * called BEFORE linking the new player in to the playerlist
+ * called BEFORE linking the new player in to the room's playerlist
  */
-int compute_average_pebbles() { 
-    int i;
+int compute_average_pebbles(struct room *room) { 
+    int *boards[MAXROOMSIZE];
+    int nplayers = room_boards(room, boards);
 
-    if (playerlist == NULL) {
-        return NPEBBLES;
-    }
-
-    int nplayers = 0, npebbles = 0;
-    for (struct player *p = playerlist; p; p = p->next) {
-        nplayers++;
-        for (i = 0; i < NPITS; i++) {
-            npebbles += p->pits[i];
-        }
-    }
-    return ((npebbles - 1) / nplayers / NPITS + 1);  /* round up */
+    return mancala_average_pebbles(boards, nplayers);
 }
 
 /*
- * returns 1 if any player's non-end pits are all empty;
+ * returns 1 if any of the room's players' non-end pits are all empty;
  * returns 0 otehrwise
  */
-int game_is_over() { /* boolean */
-    int i;
+int game_is_over(struct room *room) { /* boolean */
+    int *boards[MAXROOMSIZE];
+    int nplayers = room_boards(room, boards);
 
-    if (!playerlist) {
+    if (nplayers == 0) {
        return 0;  /* we haven't even started yet! */
     }
 
-    for (struct player *p = playerlist; p; p = p->next) {
-        int is_all_empty = 1;
-        for (i = 0; i < NPITS; i++) {
-            if (p->pits[i]) {
-                is_all_empty = 0;
-            }
-        }
-        if (is_all_empty) {
-            return 1;
-        }
-    }
-    return 0;
+    return mancala_side_empty(boards, nplayers);
 }
 
 /*
- * "broadcasts" msg to all "active" players
+ * "broadcasts" msg to all "active" players in the room
  */
-void broadcast(char *msg) {
-    if (playerlist != NULL) {
-        for (struct player *p = playerlist; p; p = p->next) {
+void broadcast(struct room *room, char *msg) {
+    if (room->playerlist != NULL) {
+        for (struct player *p = room->playerlist; p; p = p->next) {
             notify_player(&p, msg, strlen(msg));
         }
     }